@@ -14,17 +14,89 @@ typedef enum {
               
             } LORA_TX_RESULT_t;
 
-typedef void (*LORA_RES_CB_FN_t)(LORA_TX_RESULT_t e);
+// What an uplink is for : sets its priority in the tx queue and whether it is confirmed (see _msgPolicy)
+typedef enum { 
+                LORA_MSG_ALARM,         // door change
+                LORA_MSG_EVENT,         // door change in redundant history mode : the next uplinks repeat it
+                LORA_MSG_TEST,          // link test asked by the user
+                LORA_MSG_JOIN,          // first frame, its ack tells us the network is there
+                LORA_MSG_HEARTBEAT,     // unconfirmed, except every Nth which checks the link
+                LORA_MSG_LINKCHECK,     // heartbeat sent to confirm a link not seen acked for long
+                LORA_MSG_DIAG,
+                LORA_MSG_BACKLOG,       // door events the network missed, from the journal
+                LORA_NB_MSG_CLASSES
+            } LORA_MSG_CLASS_t;
+
+// Coalescing keys : a queued frame not sent yet is replaced by a newer one with the same key
+#define LORA_KEY_NONE       (0)
+#define LORA_KEY_STATUS     (1)     // door/battery status, only the latest is of interest
+#define LORA_KEY_DIAG       (2)
+
+// What became of a frame, given to the tx cb fn once the stack is done with it
+#define LORA_RSSI_UNKNOWN   (INT16_MIN)
+typedef struct {
+    LORA_TX_RESULT_t result;
+    uint8_t frameId;        // as returned by lora_app_tx()
+    bool acked;
+    uint32_t fcnt;          // uplink counter it was sent with
+    uint8_t dr;             // data rate it was sent at
+    int16_t rssi;           // of the ack (dBm), LORA_RSSI_UNKNOWN if none
+    int8_t snr;             // of the ack (dB)
+    uint16_t toaMs;         // time on air of one transmission
+    int8_t txPowerDbm;      // it was sent at
+    uint8_t txmA;           // radio supply current while sending at that power
+} LORA_TX_RES_t;
+
+// res is only valid during the call
+typedef void (*LORA_RES_CB_FN_t)(const LORA_TX_RES_t* res);
 
+// data is a buffer from the rx pool, the cb fn must give it back with lora_app_rx_free() once done with it
 typedef void (*LORA_RX_CB_FN_t)(uint8_t port, void* data, uint8_t sz);  
 
 uint16_t lora_getId(void);
+// True if lora_app_init() resumed the session saved before the last reboot, so no join is needed
+bool lora_app_resumed(void);
+// Largest frame lora_app_tx() can send at the current data rate
+uint8_t lora_app_max_payload(void);
+// Longest the stack may take to give the result of a frame of sz sent now, at the current data rate
+uint32_t lora_app_tx_timeout_ms(uint8_t sz, LORA_MSG_CLASS_t cls);
+// Longest the duty cycle may keep a frame of sz queued now before it goes (add it to the above)
+uint32_t lora_app_tx_hold_ms(uint8_t sz, LORA_MSG_CLASS_t cls);
+
+// Link quality over the last confirmed frames at the current data rate
+typedef struct {
+    uint8_t nb;             // confirmed frames in the window
+    uint8_t acked;
+    int8_t snrMin;          // of their acks (dB), INT8_MAX if none
+    int8_t snrAvg;
+    uint8_t dr;
+    int8_t txPowerDbm;
+} LORA_LINK_QUALITY_t;
+void lora_app_link_quality(LORA_LINK_QUALITY_t* lq);
 
 
 void lora_app_init( LORA_RES_CB_FN_t txcb, LORA_RX_CB_FN_t rxcb);
 
-// tx a buffer. calls the callback fn (in init()) with result : 
- LORA_TX_RESULT_t lora_app_tx(uint16_t* data, uint16_t sz, uint32_t timeoutMs);
+// timeoutMs for lora_app_tx() : as long as the stack may take at the data rate it is sent at
+#define LORA_TX_TIMEOUT_AUTO    (0)
+// queue a buffer for tx (it is copied). The callback fn (in init()) is called with the result once it is sent :
+// LORA_TX_OK_ACKD for a confirmed frame that was acked, LORA_TX_OK for an unconfirmed one that went, 
+// LORA_TX_TIMEOUT if no ack came. 
+// Only fails (LORA_TX_ERR_RETRY) if the queue is full of frames of the same or higher priority.
+// frameId (if not NULL) is set to the id its result will carry (never 0). A frame replaced in the queue by a
+// newer one with the same key gets no result of its own.
+LORA_TX_RESULT_t lora_app_tx(uint8_t* data, uint8_t sz, LORA_MSG_CLASS_t cls, uint8_t key, uint32_t timeoutMs, uint8_t* frameId);
+
+// give back a downlink buffer passed to the rx cb fn
+void lora_app_rx_free(void* data);
+
+// Max size of a diagnostic frame (fits the DR0 max payload)
+#define LORA_DIAG_MAX_SZ    (51)
+// queue a diagnostic frame on the diag port, at low priority and with no callback for its result
+LORA_TX_RESULT_t lora_app_tx_diag(uint8_t* data, uint8_t sz);
+// queue a backlog frame (see journal.h) on the backlog port, confirmed and at low priority. Its result goes
+// to the tx cb fn like any other.
+LORA_TX_RESULT_t lora_app_tx_backlog(uint8_t* data, uint8_t sz, uint8_t* frameId);
 
 
 #ifdef __cplusplus
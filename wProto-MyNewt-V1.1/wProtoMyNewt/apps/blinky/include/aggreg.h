@@ -0,0 +1,36 @@
+#ifndef H_AGGREG_H
+#define H_AGGREG_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "payload.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Uplink aggregation : door transitions and battery samples are kept with their time, and all go in the next
+ frame as its record list (see payload.h), so a burst of door moves costs one uplink.
+ Records are only dropped once aggreg_sent() says the frame carrying them went, so a failed tx loses nothing.
+ In redundant history mode (APPCFG_HISTORY_EVENTS not 0) every frame also gets the history of the last door events.
+ Only call from the sm task.
+ */
+void aggreg_init(void);
+// Record a value (PL_REC_xxx), with the journal sequence number of a door change.
+// Returns true when there is no room for another event : send now.
+bool aggreg_add(uint8_t kind, int32_t value, uint16_t seq);
+uint8_t aggreg_count(void);
+// Add the records to the frame, aged to now. Returns how many.
+uint8_t aggreg_fill(PAYLOAD_t* p);
+// Journal sequence numbers of the first and last door events the last fill added (records or history).
+// Returns how many.
+uint8_t aggreg_filled_doors(uint16_t* first, uint16_t* last);
+// The frame filled with n records was sent
+void aggreg_sent(uint8_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_AGGREG_H */
@@ -0,0 +1,36 @@
+#ifndef H_AIRTIME_H
+#define H_AIRTIME_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ EU868 airtime accounting : time on air of each uplink, against the duty cycle of the sub-band over a sliding
+ hour. The default channels (868.1/868.3/868.5) are all in the 868.0-868.6 1% sub-band, so one budget.
+ Part of it is kept for alarms, so door changes still go at once when heartbeats and diags used the rest.
+ */
+
+// Before any other call (the window is shared by the sm and lora tasks)
+void airtime_init(void);
+// Time on air (ms, rounded up) of an uplink with this application payload size at this DR
+uint32_t airtime_toa_ms(uint8_t dr, uint8_t appSz);
+// Time on air (ms) of a join request at this DR
+uint32_t airtime_join_toa_ms(uint8_t dr);
+// Radio supply current (mA) while transmitting at this power (dBm) : with the time on air, the charge of an uplink
+uint8_t airtime_tx_ma(int8_t dBm);
+// How long (ms) before an uplink of toaMs fits in the budget, 0 if it can go now. Alarms may use the reserve.
+uint32_t airtime_wait_ms(uint32_t toaMs, bool alarm);
+// An uplink of toaMs was sent
+void airtime_account(uint32_t toaMs);
+// Airtime used in the last hour
+uint32_t airtime_used_ms(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_AIRTIME_H */
@@ -0,0 +1,52 @@
+#ifndef H_APPCFG_H
+#define H_APPCFG_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "syscfg/syscfg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Application parameters that can be changed at run time (downlink commands, see dlcmd.h) and are kept in
+ flash with sys/config as "app/<key>". The id is the TLV type used to set it, do not reuse one.
+
+ APPCFG_PARAM(name, key, id, min, max, default)
+ */
+#define APPCFG_PARAMS \
+    APPCFG_PARAM(HEARTBEAT_MS,      "hb_ms",    0x01,  60000, 86400000, MYNEWT_VAL(SM_HEARTBEAT_PERIOD_MS)) \
+    APPCFG_PARAM(MAX_TRIES,         "tries",    0x02,      1,       20, 5) \
+    APPCFG_PARAM(OP_RETRY_MS,       "op_rt_ms", 0x03,   1000,  3600000, 10000) \
+    APPCFG_PARAM(ST_NOACK_RETRY_MS, "st_na_ms", 0x04,   1000,   600000, 5000) \
+    APPCFG_PARAM(ST_ERROR_RETRY_MS, "st_er_ms", 0x05,   1000,   600000, 10000) \
+    APPCFG_PARAM(LED_CONFIRM_MS,    "led_ms",   0x06,   1000,    60000, 10000) \
+    APPCFG_PARAM(AGG_WINDOW_MS,     "agg_ms",   0x07,      0,   600000, MYNEWT_VAL(SM_AGGREGATE_WINDOW_MS)) \
+    APPCFG_PARAM(HISTORY_EVENTS,    "hist",     0x08,      0,        7, MYNEWT_VAL(SM_HISTORY_EVENTS))  /* max PL_MAX_HISTORY */ \
+    APPCFG_PARAM(KEEPALIVE_MAX_MS,  "ka_max",   0x09,  60000, 86400000, MYNEWT_VAL(KEEPALIVE_MAX_MS)) \
+    APPCFG_PARAM(KEEPALIVE_LINK_MS, "ka_link",  0x0a,  60000, 86400000, MYNEWT_VAL(KEEPALIVE_LINK_MS))
+
+#define APPCFG_PARAM(n, k, id, mn, mx, def) APPCFG_##n,
+typedef enum { APPCFG_NONE, APPCFG_PARAMS APPCFG_NB } APPCFG_ID_t;
+#undef APPCFG_PARAM
+
+// For the masks of changed parameters
+#define APPCFG_BIT(p)   (1u<<(p))
+
+// Register with sys/config and load the saved values. Call before start_statemachine().
+void appcfg_init(void);
+uint32_t appcfg_get(APPCFG_ID_t p);
+// Set a parameter, saved soon after from the default event queue (any task may call it). Returns false (nothing
+// changed) if v is out of its bounds.
+bool appcfg_set(APPCFG_ID_t p, uint32_t v);
+// Back to the defaults (saved). Returns the mask of the parameters that changed.
+uint32_t appcfg_reset(void);
+// Parameter with this TLV id, or APPCFG_NONE
+APPCFG_ID_t appcfg_find(uint8_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_APPCFG_H */
@@ -0,0 +1,28 @@
+#ifndef H_DLCMD_H
+#define H_DLCMD_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Downlink commands : a sequence of TLVs, [type][len][value : len bytes, big endian].
+ type 0x01-0x3F : set the appcfg parameter with this id (see appcfg.h), value 1 to 4 bytes
+ type DLCMD_CFG_DEFAULTS : all parameters back to their defaults, no value
+ type DLCMD_DIAG : send the state machine stats diagnostic frame (smstats.h) now, no value
+ An unknown type or a bad value is skipped, a truncated TLV ends the processing.
+ */
+#define DLCMD_CFG_MAX_ID        (0x3F)
+#define DLCMD_CFG_DEFAULTS      (0x40)
+#define DLCMD_DIAG              (0x41)
+
+// Process a downlink in place. Returns the mask of the appcfg parameters changed (APPCFG_BIT()).
+uint32_t dlcmd_process(const uint8_t* data, uint8_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_DLCMD_H */
@@ -0,0 +1,28 @@
+#ifndef H_JOINSCHED_H
+#define H_JOINSCHED_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ When to send the next join attempt. Nodes powered up together (site power cut) must not join in lockstep :
+ the first attempt is at a random time, then the delay doubles on each attempt and is randomised too. It never
+ goes over the LoRaWAN join request duty cycle (1% the first hour after power up, 0.1% up to 11h, 0.01% after).
+ */
+
+// seed : something that differs between nodes (DevEUI)
+void joinsched_init(uint32_t seed);
+// Delay (ms) before the next join attempt, counting it as made
+uint32_t joinsched_next_ms(void);
+// Joined : start from the first attempt again if ever we have to rejoin
+void joinsched_joined(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_JOINSCHED_H */
@@ -0,0 +1,43 @@
+#ifndef H_JOURNAL_H
+#define H_JOURNAL_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "LoRa_message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Door event journal : each door change is appended to a ring of fixed size records in the FLASH_AREA_JOURNAL area
+ when it happens, so it outlives a link outage or a reboot (a BSP without that area, like the native sim, runs
+ without it). The events the network has not acked (the backlog) are sent once the link is back, packed many
+ to a frame on the LORA_BACKLOG_PORT :
+   version (1 byte, JOURNAL_FRAME_VERSION)
+   varint : sequence number of its first event
+   varint : age in secs of its last event when the frame was built, +1 (0 if unknown : from before a reboot)
+   per event, oldest first, varint : (delta secs<<2) | (boot<<1) | door (1=open)
+ delta is from the event before it, or from boot when boot is set (the first event after a reboot).
+ Varints are 7 bits a byte, low bits first, the top bit set on all but the last byte.
+ Any task may call it.
+ */
+#define JOURNAL_FRAME_VERSION   (1)
+
+void journal_init(void);
+// Append a door change (1=open). Returns its sequence number.
+uint16_t journal_add(uint8_t door);
+// The events first..last (sequence numbers) went in an acked frame
+void journal_delivered(uint16_t first, uint16_t last);
+// Queue the next backlog frame, if there is a backlog and no frame of it on its way
+void journal_drain(void);
+// Give it every tx result : returns true if it was for a backlog frame (so it is no one else's)
+bool journal_tx_result(const LORA_TX_RES_t* res);
+// Events not acked yet (some may have been overwritten)
+uint16_t journal_backlog(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_JOURNAL_H */
@@ -0,0 +1,36 @@
+#ifndef H_KEEPALIVE_H
+#define H_KEEPALIVE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Keepalive scheduling : the heartbeat timer ticks every APPCFG_HEARTBEAT_MS, but a tick only sends if the
+ keepalive interval is over or the link was not confirmed (acked) for APPCFG_KEEPALIVE_LINK_MS. The interval
+ starts at one tick, and doubles after each heartbeat that finds the door still and the battery within
+ KEEPALIVE_BATT_STEPS coded steps of where the run started, up to APPCFG_KEEPALIVE_MAX_MS. A door change, a battery
+ drift or a failed uplink brings it back to one tick.
+ A cage is alive as long as it sends at least every APPCFG_KEEPALIVE_MAX_MS (plus a tick).
+ Only counts ticks and uplinks, so it replays the same. Only call from the sm task.
+ */
+#define KEEPALIVE_SKIP      (0)
+#define KEEPALIVE_SEND      (1)
+#define KEEPALIVE_CHECK     (2)     // send, confirmed : the link needs checking
+
+void keepalive_init(void);
+// A heartbeat tick : KEEPALIVE_xxx
+uint8_t keepalive_tick(void);
+// An uplink went, with this battery reading, door changes or not, acked or not
+void keepalive_uplink(uint16_t battMv, bool door, bool acked);
+// An uplink failed (no ack, or not sent)
+void keepalive_failed(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_KEEPALIVE_H */
@@ -0,0 +1,31 @@
+#ifndef H_LORASESS_H
+#define H_LORASESS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ LoRaWAN session (DevAddr, session keys, frame counters) kept in flash with sys/config as "lsess/...", so a reboot
+ resumes it instead of joining again. The uplink counter is only written every 3/4 LORA_SESSION_FCNT_GAP frames,
+ and a resumed session skips LORA_SESSION_FCNT_GAP, so a counter value is never sent twice.
+ The flash writes are done from the default event queue, whatever task the calls come from.
+ */
+
+// Register the config handler : must be done before the config is loaded
+void lorasess_init(void);
+// Give the saved session to the stack (after it is configured). Returns false if there is none, so join.
+bool lorasess_restore(void);
+// Call before and after each uplink : saves a new session, or the uplink counter when it is due
+void lorasess_check(void);
+// The network seems to have forgotten us : join again at next reboot
+void lorasess_forget(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_LORASESS_H */
@@ -0,0 +1,106 @@
+#ifndef H_PAYLOAD_H
+#define H_PAYLOAD_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Uplink payload schema. Fields are packed MSB first in the order below, with no padding except
+ at the end of the last byte. A field with range [min,max] is sent as round((v-min)*(2^bits-1)/(max-min)),
+ clamped. An optional field is preceded by a presence bit, and only follows it if that bit is 1.
+ The device id is not sent : the network server has the DevEUI.
+ The fields are followed by a presence bit for the record list, then one for the history (see below).
+
+ PL_FIELD(name, bits, min, max, optional)
+ */
+#define PAYLOAD_SCHEMA \
+    PL_FIELD(VERSION,   2,     0,    3, false)   /* PAYLOAD_VERSION */ \
+    PL_FIELD(REASON,    2,     0,    3, false)   /* PL_REASON_xxx */ \
+    PL_FIELD(DOOR,      1,     0,    1, false)   /* 1 = open */ \
+    PL_FIELD(BATTERY,   8,  2000, 3600, false)   /* mV, ~6.3mV steps */ \
+    PL_FIELD(TEMP,      8,  -400,  875, true)    /* 0.1 degC, 0.5 degC steps */
+
+#define PAYLOAD_VERSION     (3)
+
+// Why the uplink was sent
+#define PL_REASON_HEARTBEAT (0)
+#define PL_REASON_DOOR      (1)
+#define PL_REASON_TEST      (2)
+#define PL_REASON_JOIN      (3)
+
+#define PL_FIELD(n, b, mn, mx, opt) PL_##n,
+typedef enum { PAYLOAD_SCHEMA PL_NB_FIELDS } PL_FIELD_ID;
+#undef PL_FIELD
+
+/*
+ Record list : past values of a field, oldest first. PL_REC_COUNT_BITS of count (1 to PL_MAX_RECORDS) then for each :
+ kind (1 bit, PL_REC_xxx), age in seconds at the time of the frame (PL_REC_AGE_BITS, saturated), value coded as the field.
+ */
+#define PL_REC_DOOR         (0)
+#define PL_REC_BATTERY      (1)
+#define PL_REC_COUNT_BITS   (4)
+#define PL_REC_AGE_BITS     (10)
+#define PL_MAX_RECORDS      ((1<<PL_REC_COUNT_BITS)-1)
+
+/*
+ History (redundant history mode only) : the last door events, sent before or not, so the receiver can rebuild
+ those of a lost frame without acks. PL_HIST_COUNT_BITS of count (1 to PL_MAX_HISTORY), the journal sequence number
+ of the newest (PL_HIST_SEQ_BITS), then newest first, each one before the previous : door (1 bit), and its time 
+ before the frame (the newest) or before the event after it. That time is coded as a 0 bit and PL_HIST_SECS_BITS
+ of seconds, or a 1 bit and PL_HIST_MINS_BITS of minutes (saturated).
+ */
+#define PL_HIST_COUNT_BITS  (3)
+#define PL_HIST_SEQ_BITS    (16)
+#define PL_HIST_SECS_BITS   (8)
+#define PL_HIST_MINS_BITS   (12)
+#define PL_MAX_HISTORY      ((1<<PL_HIST_COUNT_BITS)-1)
+
+// Worst case (all optional fields present, and the longest records and history)
+#define PL_FIELD(n, b, mn, mx, opt) + (b) + ((opt)?1:0)
+enum { PAYLOAD_MAX_BITS = 0 PAYLOAD_SCHEMA + 1 + PL_REC_COUNT_BITS + PL_MAX_RECORDS*(1+PL_REC_AGE_BITS+8) 
+        + 1 + PL_HIST_COUNT_BITS + PL_HIST_SEQ_BITS + PL_MAX_HISTORY*(1+1+PL_HIST_MINS_BITS) };
+#undef PL_FIELD
+#define PAYLOAD_MAX_SZ      ((PAYLOAD_MAX_BITS+7)/8)
+
+typedef struct {
+    uint8_t kind;               // PL_REC_xxx
+    uint16_t ageSecs;
+    int32_t value;
+} PL_RECORD_t;
+
+typedef struct {
+    int32_t values[PL_NB_FIELDS];
+    uint32_t present;           // bit per field, required fields must be set before encoding
+    uint8_t nrecs;
+    PL_RECORD_t recs[PL_MAX_RECORDS];
+    uint16_t histSeq;           // of the newest
+    uint8_t nhist;
+    struct {
+        uint8_t door;
+        uint32_t ageSecs;
+    } hist[PL_MAX_HISTORY];     // oldest first
+} PAYLOAD_t;
+
+// Clear all fields and set the version
+void payload_init(PAYLOAD_t* p);
+void payload_set(PAYLOAD_t* p, PL_FIELD_ID f, int32_t v);
+// Add a record, returns false if the list is full
+bool payload_add_record(PAYLOAD_t* p, uint8_t kind, uint16_t ageSecs, int32_t value);
+// Add a door event to the history, oldest first with consecutive seqs. Returns false if it is full.
+bool payload_add_history(PAYLOAD_t* p, uint16_t seq, uint8_t door, uint32_t ageSecs);
+// Encoded size in bytes
+uint8_t payload_size(const PAYLOAD_t* p);
+// Pack into buf, returns the number of bytes used, or 0 if buf is too small or a required field is missing
+uint8_t payload_encode(const PAYLOAD_t* p, uint8_t* buf, uint8_t sz);
+// Value as coded in the frame for field f (values with the same code are the same to the receiver)
+uint32_t payload_quantize(PL_FIELD_ID f, int32_t v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_PAYLOAD_H */
@@ -0,0 +1,22 @@
+#ifndef H_RADIOPKT_H
+#define H_RADIOPKT_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Signal quality of the last packet the radio received. The lorawan_api wrapper gives no RSSI/SNR with what it
+ receives, so this reads them from the radio driver : the only place the app looks inside the stack.
+ */
+
+// Call right after the stack said a packet (ack or downlink) came in
+void radiopkt_last(int16_t* rssi, int8_t* snr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_RADIOPKT_H */
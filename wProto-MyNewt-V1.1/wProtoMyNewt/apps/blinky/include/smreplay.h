@@ -0,0 +1,80 @@
+#ifndef H_SMREPLAY_H
+#define H_SMREPLAY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "os/os.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Capture / replay of the state machine inputs.
+ Every input the state machine consumes goes through SM_INPUT() : dispatched events, hall pin reads, battery
+ reads, lora tx return codes, the application parameters (id the parameter, read at start and on LORA_RX), and
+ what follows the DR ADR sets and the duty cycle : the max payload (SM_MAX_PAYLOAD()) and the tx timeouts.
+ With SM_CAPTURE the newest SM_CAPTURE_SIZE of them are kept with their tick in a ring, along with snapshots of
+ the state the modules registered with smcapture_state(), so the ring can be replayed from its start.
+ The ring is dumped on the console at the boot following a controlled reboot (and with 'smcap' in the shell if
+ there is one).
+ With SM_REPLAY (sim target only) the dumped stream is read back instead of the real inputs and run through the
+ state machine under virtual time, so a field trace is reproduced bit-exactly in a few ms.
+ */
+typedef enum { SMIN_EVENT, SMIN_HALL, SMIN_BATT, SMIN_TXRET, SMIN_CFG, SMIN_SESSION, SMIN_MAXPL, SMIN_TXTIME } SMIN_KIND;
+
+// checks a sealed capture from the previous run (dumps it) and registers the 'smcap' shell command
+void smcapture_init(void);
+#if MYNEWT_VAL(SM_CAPTURE)
+void smcapture_event(uint8_t e, uint32_t data);
+uint32_t smcapture_input(SMIN_KIND k, uint8_t id, uint32_t v);
+// Between two dispatches : take a snapshot of the registered state if the newest one is getting old
+void smcapture_snapshot(void);
+// Compute the CRC so the capture is dumped after the coming reboot
+void smcapture_seal(void);
+#else
+#define smcapture_event(e, d)
+#define smcapture_input(k, id, v) (v)
+#define smcapture_snapshot()
+#define smcapture_seal()
+#endif
+#if MYNEWT_VAL(SM_CAPTURE) || MYNEWT_VAL(SM_REPLAY)
+// Register state the state machine depends on (no pointers) : saved in the snapshots, restored by a replay.
+// Must be called at init, in the same order on every build.
+void smcapture_state(void* p, uint16_t sz);
+#else
+#define smcapture_state(p, sz)
+#endif
+
+#if MYNEWT_VAL(SM_REPLAY)
+// load the stream : must be called before the state machine is started
+void smreplay_init(void);
+// restore the snapshot the stream starts from, false if it starts at boot
+bool smreplay_snapshot(void);
+// run the recorded events through the state machine, print the results and exit
+void smreplay_run(void);
+// end the replay early (reboot reached)
+void smreplay_finish(const char* why);
+uint32_t smreplay_input(SMIN_KIND k, uint8_t id);
+os_time_t smreplay_time(void);
+#define smreplay_active() (true)
+#else
+#define smreplay_active() (false)
+#define smreplay_input(k, id) (0)
+#define smreplay_time() (0)
+#endif
+
+// Read an input : live (and captured) or from the replay stream. expr is not evaluated when replaying.
+// id tells apart inputs of the same kind (the replay checks it too).
+#define SM_INPUT_ID(k, id, expr) (smreplay_active()?smreplay_input((k), (id)):smcapture_input((k), (id), (expr)))
+#define SM_INPUT(k, expr) SM_INPUT_ID((k), 0, (expr))
+// The max payload at the current DR (LoRa_message.h)
+#define SM_MAX_PAYLOAD() ((uint8_t)SM_INPUT(SMIN_MAXPL, lora_app_max_payload()))
+// Time seen by the state machine and its statistics
+#define sm_time_get() (smreplay_active()?smreplay_time():os_time_get())
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_SMREPLAY_H */
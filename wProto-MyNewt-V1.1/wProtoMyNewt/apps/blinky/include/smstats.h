@@ -0,0 +1,57 @@
+#ifndef H_SMSTATS_H
+#define H_SMSTATS_H
+
+#include <inttypes.h>
+#include "statemach.h"
+#include "LoRa_message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ State machine statistics : time spent in each state, number of entries and cost of the transition handlers.
+ The block lives in no-init RAM so it survives a soft reboot (eg from FATAL_ERROR), and is readable from the 
+ shell ('smstats'), the console at boot, or as a LoRa diagnostic frame sent every SM_STATS_DIAG_PERIOD_H hours.
+ */
+typedef struct {
+    uint16_t entries;           // saturates at 0xFFFF
+    uint16_t residencyMs;       // < 1000, remainder of residencyS
+    uint32_t residencyS;
+    uint32_t handlerUs;         // total EXIT+ENTER handler time for transitions into this state
+    uint16_t handlerMaxUs;
+} SM_STATE_STATS_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t boots;             // boots survived by the block
+    uint8_t maxChain;           // deepest run to completion chain
+    uint8_t chainAborts;
+    uint16_t stackUsedMax;      // sm task stack high water mark, in words
+    uint16_t evqOverflows;
+    SM_STATE_STATS_t states[SM_NB_STATES];
+} SM_STATS_t;
+
+// Called at state machine start : keeps the block if it survived a reboot
+void smstats_init(void);
+// Account a transition 'from'->'to', whose exit/enter handlers took 'handlerUs'
+void smstats_transition(STATE from, STATE to, uint32_t handlerUs);
+// Account a completed run to completion chain of 'chain' transitions, and current stack use
+void smstats_chain(uint8_t chain, uint16_t stackUsed);
+void smstats_chain_abort(void);
+void smstats_evq_overflow(uint16_t nb);
+const SM_STATS_t* smstats_get(void);
+void smstats_reset(void);
+void smstats_dump(void);
+// Build the diagnostic frame into buf, returns its length
+uint8_t smstats_build_frame(uint8_t* buf, uint8_t sz);
+// Build and tx the diagnostic frame now
+LORA_TX_RESULT_t smstats_send_diag(void);
+// Ask for the diagnostic frame from the default event queue (safe from any task), the period restarts after it
+void smstats_diag_request(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_SMSTATS_H */
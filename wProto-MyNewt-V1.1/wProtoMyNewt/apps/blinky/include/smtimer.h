@@ -0,0 +1,42 @@
+#ifndef H_SMTIMER_H
+#define H_SMTIMER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "os/os.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Named timers for the state machine, all multiplexed on a single callout armed for the earliest deadline.
+ Not thread safe : only call from the task running the event queue given to smtimer_init() (the sm task).
+ */
+typedef enum {
+    SMT_STATE,              // state timeout, owned by the current state
+    SMT_HEARTBEAT,          // periodic, runs across transitions
+    SMT_RETRY,              // retry/backoff delays
+    SMT_LED_CONFIRM,        // end of a confirmation LED display
+    SMT_AGGREGATE,          // end of the uplink aggregation window
+    SMT_NB_TIMERS
+} SMT_ID;
+
+// Called in the queue's task for each expired timer, in deadline order
+typedef void (*SMT_EXPIRED_FN_t)(SMT_ID id);
+
+void smtimer_init(struct os_eventq* q, SMT_EXPIRED_FN_t fn);
+// (Re)start a one shot timer
+void smtimer_start(SMT_ID id, uint32_t ms);
+// (Re)start a periodic timer : the next deadline is computed from the previous one, so the cadence does not drift
+void smtimer_start_periodic(SMT_ID id, uint32_t periodMs);
+void smtimer_stop(SMT_ID id);
+bool smtimer_running(SMT_ID id);
+// ms until expiry, 0 if not running
+uint32_t smtimer_remaining(SMT_ID id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_SMTIMER_H */
@@ -0,0 +1,37 @@
+#ifndef H_SMTRACE_H
+#define H_SMTRACE_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Binary trace of the state machine : a fixed ring of (tick, from, event, data, to) records in no-init RAM.
+ Adding a record is a few stores. Before a controlled reboot the ring is sealed with a CRC; at the next boot
+ a valid ring is kept (and continued) : a copy of it is flushed to the REBOOT_LOG flash area a bit later, where
+ the traces of the past reboots are kept as a ring, SM_TRACE_ERASE_SIZE bytes erased at a time.
+ */
+typedef struct {
+    uint32_t tick;          // os_time
+    uint8_t from;
+    uint8_t event;          // SMTRACE_BOOT for the marker added at each boot
+    uint8_t data;           // low byte of the event data (tx result, pin level...)
+    uint8_t to;
+} SM_TRACE_REC_t;
+
+#define SMTRACE_BOOT    (0xFF)
+
+void smtrace_init(void);
+// Hot path : record one dispatched event
+void smtrace_add(uint8_t from, uint8_t event, uint32_t data, uint8_t to);
+// Compute the CRC so the ring is accepted after the coming reboot
+void smtrace_seal(void);
+void smtrace_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_SMTRACE_H */
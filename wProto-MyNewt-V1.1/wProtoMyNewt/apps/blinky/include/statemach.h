@@ -23,10 +23,17 @@ typedef enum {
                 OP_SIGNAL_OK,
                 OP_SIGNAL_ERROR,
                 OP_SIGNAL_TIMEOUT,
-            
+                SM_NB_STATES        // must be last : size of the state table
             } STATE;
 
-typedef enum { ENTER, EXIT, TIMEOUT, LORA_TX_STATUS, LORA_RX, IRQ_HALL, IRQ_BUTT } EVENT;
+// LORA_TX_STATUS data is SM_TX_STATUS(frame id, LORA_TX_RESULT_t), IRQ_HALL data is the settled hall pin level, 
+// IRQ_BUTT data is the button pin level sampled in the IRQ.
+// TIMEOUT is the state timer, TIMEOUT_xxx the other named timers (see smtimer.h)
+typedef enum { ENTER, EXIT, TIMEOUT, LORA_TX_STATUS, LORA_RX, IRQ_HALL, IRQ_BUTT, 
+                TIMEOUT_HEARTBEAT, TIMEOUT_RETRY, TIMEOUT_LED, TIMEOUT_AGG, SM_NB_EVENTS } EVENT;
+
+// Event data fits a word so it can be captured and replayed : which frame, and how it went
+#define SM_TX_STATUS(id, res)   ((void*)(uintptr_t)((((uint32_t)(id))<<8) | ((res) & 0xff)))
 
 
 
@@ -35,6 +42,12 @@ typedef enum { ENTER, EXIT, TIMEOUT, LORA_TX_STATUS, LORA_RX, IRQ_HALL, IRQ_BUTT
 void start_statemachine(void) ;
 /*make transition betwenn the event*/
 void sendEvent(EVENT e, void* data); 
+/*current state*/
+STATE sm_get_state(void);
+/*dispatch an event synchronously in the caller's context (replay), returns the new state*/
+STATE sm_inject(EVENT e, void* data);
+/*application parameter (APPCFG_xxx) as the state machine uses it : read at start and on LORA_RX*/
+uint32_t sm_cfg_get(uint8_t p);
 
 
 
@@ -0,0 +1,35 @@
+#ifndef H_TPC_H
+#define H_TPC_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Transmit power control : how far above the demodulation floor we hear the network (SNR of its acks and
+ downlinks) says how much power the uplink can spare. Step down 2dB after LORA_TPC_STEP_AFTER margins in a row
+ that still leave LORA_TPC_MARGIN_DB once down, back up 2dB as soon as the margin is short or an ack is missed,
+ and to full power when the link is lost. The SNR saturates (~+10dB) on strong signals, which only makes this
+ more careful.
+ This only decides the power : the caller sets it on the radio, then tells it with tpc_set().
+ */
+
+// maxDbm : the configured tx power, also the one in use at start
+void tpc_init(int8_t maxDbm);
+// Tx power in use
+int8_t tpc_dbm(void);
+// The radio now sends at dBm
+void tpc_set(int8_t dBm);
+// SNR of an ack or downlink received while sending at this DR : returns the tx power to use
+int8_t tpc_margin(int8_t snr, uint8_t dr);
+// A confirmed frame was not acked (lost : the link is declared lost) : returns the tx power to use
+int8_t tpc_missed(bool lost);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_TPC_H */
@@ -11,24 +11,122 @@
 
 #include "lorawan_api/lorawan_api.h"
 #include "os/mynewt.h"
+#include "LoRaMac.h"
 
 #include "wutils.h"
+#include "airtime.h"
+#include "lorasess.h"
+#include "radiopkt.h"
+#include "tpc.h"
 #include "LoRa_message.h"
 
 
 #define LORA_APP_PORT                     3
+#define LORA_DIAG_PORT          MYNEWT_VAL(LORA_DIAG_PORT)
+#define LORA_BACKLOG_PORT       MYNEWT_VAL(LORA_BACKLOG_PORT)
 #define LORAAPP_TASK_PRIO       MYNEWT_VAL(LORAAPP_TASK_PRIO)
 #define LORAAPP_TASK_STACK_SZ   MYNEWT_VAL(LORAAPP_STACK_SIZE)
+#define LORA_TXQ_SZ             MYNEWT_VAL(LORA_TXQ_SIZE)
+#define LORA_TXQ_FRAME_SZ       MYNEWT_VAL(LORA_TXQ_FRAME_SIZE)
+#define LORA_RX_POOL_SZ         MYNEWT_VAL(LORA_RX_POOL_SIZE)
+#define LORA_RX_BUF_SZ          MYNEWT_VAL(LORA_RX_BUF_SIZE)
+#define LORA_RX_POLL_MS         MYNEWT_VAL(LORA_RX_POLL_MS)
+#define LINKCHECK_EVERY         MYNEWT_VAL(LORA_LINKCHECK_EVERY)
+#define LINKCHECK_MAX_MISSES    MYNEWT_VAL(LORA_LINKCHECK_MAX_MISSES)
+#define LORA_NB_TRIALS          MYNEWT_VAL(LORAWAN_API_DEFAULT_NB_TRIALS)
+// EU868 tx power index : 2dB steps down from 14dBm
+#define LORA_TXPOWER_INDEX(dBm) ((14-(dBm))/2)
+#define LQ_WINDOW               MYNEWT_VAL(LORA_LQ_WINDOW)
+#define ADR_FALLBACK_MISSES     MYNEWT_VAL(LORA_ADR_FALLBACK_MISSES)
+// LoRaWAN 1.0 class A timings (EU868 defaults) : RX2 at 2s (join accept 6s) at DR0, retry up to 3s after it
+#define LORA_RX2_DELAY_MS       (2000)
+#define LORA_JOIN_RX2_DELAY_MS  (6000)
+#define LORA_RX2_DR             (0)
+#define LORA_ACK_TIMEOUT_MS     (3000)
+#define LORA_TX_SLACK_MS        (1000)
+
+#if LORA_TXQ_FRAME_SZ<LORA_DIAG_MAX_SZ
+#error "LORA_TXQ_FRAME_SIZE must hold a diag frame"
+#endif
 
 
 
 static os_stack_t _loraapp_task_stack[LORAAPP_TASK_STACK_SZ];
 static struct os_task _loraapp_task_str;
-static struct os_sem _lora_tx_sem;
+static struct os_sem _lora_tx_sem;       // released on each put in the queue, to wake the task (extra tokens only cost a look at the queue)
 
 static lorawan_sock_t _sock_tx;
 static lorawan_sock_t _sock_rx;
-static bool _canTx = false;
+static bool _resumed = false;           // saved session given to the stack, no join needed
+
+/*
+ * Outbound queue : frames wait here, highest priority first then oldest first, until the loraapp task 
+ * is free to send them, so the app never has to wait for (or fail because of) a tx/rx in progress.
+ * The frame being sent is out of the queue but keeps its block until its result, as the stack may not
+ * copy the data.
+ */
+struct lora_txq_entry {
+    STAILQ_ENTRY(lora_txq_entry) next;
+    uint8_t cls;                // LORA_MSG_CLASS_t
+    uint8_t prio;               // LORA_PRIO_xxx
+    uint8_t key;                // LORA_KEY_xxx
+    uint8_t port;
+    uint8_t sz;
+    uint8_t id;                 // frame id given to the app, in its result
+    bool notify;                // result to the tx cb fn
+    uint32_t timeoutMs;
+    uint8_t data[LORA_TXQ_FRAME_SZ];
+};
+static STAILQ_HEAD(, lora_txq_entry) _txq = STAILQ_HEAD_INITIALIZER(_txq);
+static struct os_mempool _txqPool;
+static os_membuf_t _txqMem[OS_MEMPOOL_SIZE(LORA_TXQ_SZ, sizeof(struct lora_txq_entry))];
+static struct os_mutex _txqMutex;
+static uint8_t _lastFrameId = 0;
+
+// Downlinks are received in a pool block which is given to the rx cb fn, who frees it with lora_app_rx_free()
+static struct os_mempool _rxPool;
+static os_membuf_t _rxMem[OS_MEMPOOL_SIZE(LORA_RX_POOL_SZ, LORA_RX_BUF_SZ)];
+
+// Priority in the tx queue : the highest waiting is sent first
+#define LORA_PRIO_LOW       (0)
+#define LORA_PRIO_NORMAL    (1)
+#define LORA_PRIO_ALARM     (2)
+
+/*
+ * Uplink policy : an ack costs the gateway a downlink and us the rx windows, so only ask for one where 
+ * it matters. Heartbeats check the link every LORA_LINKCHECK_EVERY frames, and all of them do while a
+ * check is failing, until one is acked.
+ */
+#define LORA_ACK_NEVER      (0)
+#define LORA_ACK_ALWAYS     (1)
+#define LORA_ACK_LINKCHECK  (2)
+static const struct {
+    uint8_t prio;
+    uint8_t ack;
+} _msgPolicy[LORA_NB_MSG_CLASSES] = {
+    [LORA_MSG_ALARM] = { .prio = LORA_PRIO_ALARM, .ack = LORA_ACK_ALWAYS },
+    [LORA_MSG_EVENT] = { .prio = LORA_PRIO_ALARM, .ack = LORA_ACK_NEVER },
+    [LORA_MSG_TEST] = { .prio = LORA_PRIO_ALARM, .ack = LORA_ACK_ALWAYS },
+    [LORA_MSG_JOIN] = { .prio = LORA_PRIO_NORMAL, .ack = LORA_ACK_ALWAYS },
+    [LORA_MSG_HEARTBEAT] = { .prio = LORA_PRIO_NORMAL, .ack = LORA_ACK_LINKCHECK },
+    [LORA_MSG_LINKCHECK] = { .prio = LORA_PRIO_NORMAL, .ack = LORA_ACK_ALWAYS },
+    [LORA_MSG_DIAG] = { .prio = LORA_PRIO_LOW, .ack = LORA_ACK_NEVER },
+    [LORA_MSG_BACKLOG] = { .prio = LORA_PRIO_LOW, .ack = LORA_ACK_ALWAYS },
+};
+static struct {
+    uint8_t sinceCheck;     // link check frames sent unconfirmed since the last check
+    uint8_t missed;         // confirmed frames not acked in a row
+} _link;
+// Link quality : the last LQ_WINDOW confirmed frames, at the current DR
+static struct {
+    struct {
+        bool acked;
+        int8_t snr;
+    } recs[LQ_WINDOW];
+    uint8_t next;
+    uint8_t nb;
+    uint8_t dr;
+} _lq;
 
 
 static struct loraapp_config {
@@ -38,7 +136,6 @@ static struct loraapp_config {
     uint8_t rxPort;
     uint8_t loraDR;
     int8_t txPower;
-    uint32_t txTimeoutMs;
     uint8_t deveui[8];
     uint8_t appeui[8];
     uint8_t appkey[16];
@@ -48,12 +145,11 @@ static struct loraapp_config {
 } _loraCfg = 
 {
     .useAck = false,
-    .useAdr = false,
+    .useAdr = MYNEWT_VAL(LORAWAN_ADR_ENABLE),
     .txPort=3,
     .rxPort=3,
     .loraDR=0,
     .txPower=14,
-    .txTimeoutMs=10000,
     /*University keys*/
     
     .deveui = { 0x38, 0xb8, 0xeb, 0xe0, 0x00, 0x00, 0x00, 0xaa},
@@ -75,17 +171,114 @@ uint16_t lora_getId(void)
     return (_loraCfg.deveui[6] << 8) + _loraCfg.deveui[7];
 }
 
+// EU868 max application payload for each DR (no MAC commands piggybacked)
+static const uint8_t _maxPayloadByDR[] = { 51, 51, 51, 115, 222, 222, 222, 222 };
+
+// DR the stack will use for the next uplink
+static uint8_t lora_current_dr(void) 
+{
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_CHANNELS_DATARATE;
+    if (LoRaMacMibGetRequestConfirm(&mib)==LORAMAC_STATUS_OK) 
+    {
+        return mib.Param.ChannelsDatarate;
+    }
+    return _loraCfg.loraDR;
+}
+
+static int8_t lora_current_txpower(void) 
+{
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_CHANNELS_TX_POWER;
+    if (LoRaMacMibGetRequestConfirm(&mib)==LORAMAC_STATUS_OK) 
+    {
+        return _loraCfg.txPower-2*mib.Param.ChannelsTxPower;
+    }
+    return tpc_dbm();
+}
+
+/*
+ * Longest the stack may take to give the result of an uplink of sz bytes at this DR : each transmission, 
+ * its RX2 window (the later one) for an ack of no payload, and for a confirmed one the ack timeout before 
+ * the next trial. A join first has its own request and join accept (33 bytes) windows.
+ */
+static uint32_t lora_tx_time_ms(uint8_t dr, uint8_t sz, LORA_MSG_CLASS_t cls) 
+{
+    uint32_t t = airtime_toa_ms(dr, sz) + LORA_RX2_DELAY_MS + airtime_toa_ms(LORA_RX2_DR, 0);
+    if (_msgPolicy[cls].ack!=LORA_ACK_NEVER) 
+    {
+        t = LORA_NB_TRIALS*(t+LORA_ACK_TIMEOUT_MS);
+    }
+    if (cls==LORA_MSG_JOIN) 
+    {
+        t += airtime_join_toa_ms(dr) + LORA_JOIN_RX2_DELAY_MS + airtime_toa_ms(LORA_RX2_DR, 33-13);
+    }
+    return t+LORA_TX_SLACK_MS;
+}
+
+uint32_t lora_app_tx_timeout_ms(uint8_t sz, LORA_MSG_CLASS_t cls) 
+{
+    return lora_tx_time_ms(lora_current_dr(), sz, cls);
+}
+
+void lora_app_link_quality(LORA_LINK_QUALITY_t* lq) 
+{
+    int snrSum = 0;
+    lq->nb = _lq.nb;
+    lq->acked = 0;
+    lq->snrMin = INT8_MAX;
+    lq->snrAvg = 0;
+    lq->dr = lora_current_dr();
+    lq->txPowerDbm = tpc_dbm();
+    for(int i=0;i<_lq.nb;i++) 
+    {
+        if (_lq.recs[i].acked) 
+        {
+            lq->acked++;
+            snrSum += _lq.recs[i].snr;
+            if (_lq.recs[i].snr<lq->snrMin) 
+            {
+                lq->snrMin = _lq.recs[i].snr;
+            }
+        }
+    }
+    if (lq->acked>0) 
+    {
+        lq->snrAvg = snrSum/lq->acked;
+    }
+}
+
+bool lora_app_resumed(void) 
+{
+    return _resumed;
+}
+
+uint8_t lora_app_max_payload(void) 
+{
+    uint8_t dr = lora_current_dr();
+    uint8_t max = (dr<sizeof(_maxPayloadByDR))?_maxPayloadByDR[dr]:_maxPayloadByDR[0];
+    // and it has to fit in the tx queue
+    return (max<LORA_TXQ_FRAME_SZ)?max:LORA_TXQ_FRAME_SZ;
+}
+
 
 // initialise lorawan stack with our config
 void lora_app_init( LORA_RES_CB_FN_t txcb, LORA_RX_CB_FN_t rxcb)
 {
-    int status = lorawan_configure_OTAA(_loraCfg.deveui, _loraCfg.appeui, _loraCfg.appkey, 1, ((14-_loraCfg.txPower)/2),  MYNEWT_VAL(LORA_REGION));
+    int status = lorawan_configure_OTAA(_loraCfg.deveui, _loraCfg.appeui, _loraCfg.appkey, 1, LORA_TXPOWER_INDEX(_loraCfg.txPower),  MYNEWT_VAL(LORA_REGION));
     assert(status == LORAWAN_STATUS_OK);
     console_printf("Starting LoRaWAN in OTAA mode [with devEUI: %02x%02x%02x%02x%02x%02x%02x%02x] \r\n",
         _loraCfg.deveui[0],_loraCfg.deveui[1],_loraCfg.deveui[2],_loraCfg.deveui[3],_loraCfg.deveui[4],_loraCfg.deveui[5],_loraCfg.deveui[6],_loraCfg.deveui[7]);
 
-    // TODO this is not reglo
+    // Duty cycle is kept by the airtime accounting, which holds frames till they may go instead of refusing them
     lorawan_set_dutycycle(false);
+    _resumed = lorasess_restore();
+    tpc_init(_loraCfg.txPower);
+    // the network tunes DR and tx power once it knows the link, from LORAWAN_API_DEFAULT_DR
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_ADR;
+    mib.Param.AdrEnable = _loraCfg.useAdr;
+    LoRaMacMibSetRequestConfirm(&mib);
         // set cbfn, indcating lock of lora
     _txcbfn = txcb;
     _rxcbfn = rxcb;
@@ -95,7 +288,6 @@ void lora_app_init( LORA_RES_CB_FN_t txcb, LORA_RX_CB_FN_t rxcb)
         /* 1st action: obtain a socket from the LoRaWAN API */
         _sock_tx = lorawan_socket(SOCKET_TYPE_TX);
         assert(_sock_tx != 0);
-        _canTx = true;
     }
     if (_rxcbfn!=NULL) 
     {
@@ -109,6 +301,10 @@ void lora_app_init( LORA_RES_CB_FN_t txcb, LORA_RX_CB_FN_t rxcb)
     
     // need a semaphore...
     os_sem_init(&_lora_tx_sem,0);
+    os_mutex_init(&_txqMutex);
+    airtime_init();
+    assert(os_mempool_init(&_txqPool, LORA_TXQ_SZ, sizeof(struct lora_txq_entry), _txqMem, "loratxq")==0);
+    assert(os_mempool_init(&_rxPool, LORA_RX_POOL_SZ, LORA_RX_BUF_SZ, _rxMem, "lorarx")==0);
     // Create task to run TX/RX as KLK wrapper uses blocking calls... thanks guys...
     os_task_init(&_loraapp_task_str, "lw_eventq",
                  loraapp_task, NULL,
@@ -118,113 +314,523 @@ void lora_app_init( LORA_RES_CB_FN_t txcb, LORA_RX_CB_FN_t rxcb)
 }
 
 
-// Use static buffer in case api doesn't copy it
-static uint8_t _txBuffer[255]={0};
-// tx a buffer. returns result enum indicating tx ok, ack rx, or error
-LORA_TX_RESULT_t lora_app_tx(uint16_t* data, uint16_t sz, uint32_t timeoutMs) 
+// Insert after the frames of the same or higher priority. Call with _txqMutex held.
+static void lora_txq_insert(struct lora_txq_entry* e) 
+{
+    struct lora_txq_entry* prev = NULL;
+    struct lora_txq_entry* it;
+    STAILQ_FOREACH(it, &_txq, next) 
+    {
+        if (it->prio<e->prio) 
+        {
+            break;
+        }
+        prev = it;
+    }
+    if (prev==NULL) 
+    {
+        STAILQ_INSERT_HEAD(&_txq, e, next);
+    } 
+    else 
+    {
+        STAILQ_INSERT_AFTER(&_txq, prev, e, next);
+    }
+}
+
+// Oldest of the lowest priority frames, if lower than prio. Call with _txqMutex held.
+static struct lora_txq_entry* lora_txq_victim(uint8_t prio) 
+{
+    struct lora_txq_entry* victim = NULL;
+    struct lora_txq_entry* it;
+    STAILQ_FOREACH(it, &_txq, next) 
+    {
+        if (it->prio<prio && (victim==NULL || it->prio<victim->prio)) 
+        {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
+static LORA_TX_RESULT_t lora_txq_put(uint8_t port, uint8_t* data, uint8_t sz, LORA_MSG_CLASS_t cls, uint8_t key, bool notify, uint32_t timeoutMs, uint8_t* frameId) 
 {
     assert(_sock_tx!=0);        // no txing if you didnt init for it
-    if (!_canTx) 
+    assert(sz<=LORA_TXQ_FRAME_SZ);
+    assert(cls<LORA_NB_MSG_CLASSES);
+    uint8_t prio = _msgPolicy[cls].prio;
+    os_mutex_pend(&_txqMutex, OS_TIMEOUT_NEVER);
+    struct lora_txq_entry* e = NULL;
+    if (key!=LORA_KEY_NONE) 
     {
-        return LORA_TX_ERR_RETRY;
+        // latest wins : take over the unsent frame, keeping the higher priority of the two
+        STAILQ_FOREACH(e, &_txq, next) 
+        {
+            if (e->key==key) 
+            {
+                break;
+            }
+        }
+        if (e!=NULL) 
+        {
+            STAILQ_REMOVE(&_txq, e, lora_txq_entry, next);
+            if (e->prio>prio) 
+            {
+                // and its policy with it
+                prio = e->prio;
+                cls = e->cls;
+            }
+            notify = (notify || e->notify);
+        }
     }
+    if (e==NULL) 
+    {
+        e = os_memblock_get(&_txqPool);
+        if (e==NULL) 
+        {
+            e = lora_txq_victim(prio);
+            if (e==NULL) 
+            {
+                os_mutex_release(&_txqMutex);
+                console_printf("lora tx queue full\r\n");
+                return LORA_TX_ERR_RETRY;
+            }
+            STAILQ_REMOVE(&_txq, e, lora_txq_entry, next);
+            console_printf("lora tx queue full, dropped a frame for port %d\r\n", e->port);
+        }
+    }
+    e->cls = cls;
+    e->prio = prio;
+    e->key = key;
+    e->port = port;
+    e->sz = sz;
+    e->notify = notify;
+    e->timeoutMs = timeoutMs;
+    // a new id even when taking over a queued frame : the old one will get no result
+    if (++_lastFrameId==0) 
+    {
+        _lastFrameId = 1;
+    }
+    e->id = _lastFrameId;
+    if (frameId!=NULL) 
+    {
+        *frameId = e->id;
+    }
+    memcpy(e->data, data, sz);
+    lora_txq_insert(e);
+    os_mutex_release(&_txqMutex);
+    // even with no new frame : a frame taken over may have gone up in priority, and be let through
+    // the duty cycle reserve now, while the task sleeps on the wait of the old head
+    os_sem_release(&_lora_tx_sem);
+    return LORA_TX_OK;
+}
 
-    _loraCfg.txTimeoutMs = timeoutMs;
-    memcpy(_txBuffer, data, sz);
+// Worst case airtime of a frame : a confirmed one may be sent LORA_NB_TRIALS times
+static uint32_t lora_txq_airtime(struct lora_txq_entry* e) 
+{
+    uint32_t toa = airtime_toa_ms(lora_current_dr(), e->sz);
+    return (_msgPolicy[e->cls].ack!=LORA_ACK_NEVER)?(toa*LORA_NB_TRIALS):toa;
+}
 
-    console_printf("TX thread started\r\n");  
+uint32_t lora_app_tx_hold_ms(uint8_t sz, LORA_MSG_CLASS_t cls) 
+{
+    // as if all the frames queued went first : they may, at a priority at least ours
+    uint32_t toa = airtime_toa_ms(lora_current_dr(), sz);
+    if (_msgPolicy[cls].ack!=LORA_ACK_NEVER) 
+    {
+        toa *= LORA_NB_TRIALS;
+    }
+    struct lora_txq_entry* e;
+    os_mutex_pend(&_txqMutex, OS_TIMEOUT_NEVER);
+    STAILQ_FOREACH(e, &_txq, next) 
+    {
+        toa += lora_txq_airtime(e);
+    }
+    os_mutex_release(&_txqMutex);
+    return airtime_wait_ms(toa, (_msgPolicy[cls].prio==LORA_PRIO_ALARM));
+}
+
+// Take the head frame if the duty cycle allows it now. If not, it stays queued and waitMs says for how long
+static struct lora_txq_entry* lora_txq_get(uint32_t* waitMs) 
+{
+    *waitMs = 0;
+    os_mutex_pend(&_txqMutex, OS_TIMEOUT_NEVER);
+    struct lora_txq_entry* e = STAILQ_FIRST(&_txq);
+    if (e!=NULL) 
+    {
+        *waitMs = airtime_wait_ms(lora_txq_airtime(e), (e->prio==LORA_PRIO_ALARM));
+        if (*waitMs==0) 
+        {
+            STAILQ_REMOVE_HEAD(&_txq, next);
+        } 
+        else 
+        {
+            e = NULL;
+        }
+    }
+    os_mutex_release(&_txqMutex);
+    return e;
+}
+
+// Put back a frame the stack refused for now, unless a newer one with the same key was queued meanwhile
+static void lora_txq_putback(struct lora_txq_entry* e) 
+{
+    struct lora_txq_entry* it = NULL;
+    os_mutex_pend(&_txqMutex, OS_TIMEOUT_NEVER);
+    if (e->key!=LORA_KEY_NONE) 
+    {
+        STAILQ_FOREACH(it, &_txq, next) 
+        {
+            if (it->key==e->key) 
+            {
+                it->notify = (it->notify || e->notify);
+                break;
+            }
+        }
+    }
+    if (it==NULL) 
+    {
+        lora_txq_insert(e);
+    } 
+    else 
+    {
+        os_memblock_put(&_txqPool, e);
+    }
+    os_mutex_release(&_txqMutex);
+    if (it==NULL) 
+    {
+        os_sem_release(&_lora_tx_sem);
+    }
+}
+
+// queue a buffer for tx. returns LORA_TX_OK if queued, the result is given to the cb fn once sent
+LORA_TX_RESULT_t lora_app_tx(uint8_t* data, uint8_t sz, LORA_MSG_CLASS_t cls, uint8_t key, uint32_t timeoutMs, uint8_t* frameId) 
+{
+    return lora_txq_put(_loraCfg.txPort, data, sz, cls, key, true, timeoutMs, frameId);
+}
+
+LORA_TX_RESULT_t lora_app_tx_diag(uint8_t* data, uint8_t sz) 
+{
+    assert(sz<=LORA_DIAG_MAX_SZ);
+    return lora_txq_put(LORA_DIAG_PORT, data, sz, LORA_MSG_DIAG, LORA_KEY_DIAG, false, LORA_TX_TIMEOUT_AUTO, NULL);
+}
+
+LORA_TX_RESULT_t lora_app_tx_backlog(uint8_t* data, uint8_t sz, uint8_t* frameId) 
+{
+    return lora_txq_put(LORA_BACKLOG_PORT, data, sz, LORA_MSG_BACKLOG, LORA_KEY_NONE, true, LORA_TX_TIMEOUT_AUTO, frameId);
+}
+
+// Should this frame ask for an ack?
+static bool lora_policy_confirmed(uint8_t cls) 
+{
+    switch(_msgPolicy[cls].ack) 
+    {
+        case LORA_ACK_ALWAYS:
+            return true;
+        case LORA_ACK_LINKCHECK: 
+        {
+            if (_link.missed>0 || (_link.sinceCheck+1)>=LINKCHECK_EVERY) 
+            {
+                _link.sinceCheck = 0;
+                return true;
+            }
+            _link.sinceCheck++;
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+// The only place that knows how the api selects a confirmed or unconfirmed uplink
+static void lora_set_confirmed(bool confirmed) 
+{
+    uint8_t mcps = confirmed?LORAWAN_MCPS_CONFIRMED:LORAWAN_MCPS_UNCONFIRMED;
+    lorawan_setsockopt(_sock_tx, LORAWAN_SOCKOPT_MCPS_TYPE, &mcps);
+}
+
+// Set the tx power tpc asks for (tpc.h)
+static void lora_tpc_set(int8_t dBm) 
+{
+    if (dBm==tpc_dbm()) 
+    {
+        return;
+    }
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_CHANNELS_TX_POWER;
+    mib.Param.ChannelsTxPower = LORA_TXPOWER_INDEX(dBm);
+    if (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK) 
+    {
+        console_printf("lora tx power %d -> %d dBm\r\n", tpc_dbm(), dBm);
+        tpc_set(dBm);
+    }
+}
+
+static void lora_tpc_margin(int8_t snr) 
+{
+    if (_loraCfg.useAdr) 
+    {
+        // the network lowers the power itself once at the top DR
+        return;
+    }
+    lora_tpc_set(tpc_margin(snr, lora_current_dr()));
+}
+
+// A confirmed frame sent at dr : acked (with snr) or not
+static void lora_lq_add(uint8_t dr, bool acked, int8_t snr) 
+{
+    if (dr!=_lq.dr) 
+    {
+        // what we had is for another DR
+        _lq.nb = 0;
+        _lq.next = 0;
+        _lq.dr = dr;
+    }
+    _lq.recs[_lq.next].acked = acked;
+    _lq.recs[_lq.next].snr = snr;
+    _lq.next = (_lq.next+1)%LQ_WINDOW;
+    if (_lq.nb<LQ_WINDOW) 
+    {
+        _lq.nb++;
+    }
+}
+
+/*
+ * The LoRaWAN ADR backoff (full power, then down one DR at a time) only starts after ADR_ACK_LIMIT+ADR_ACK_DELAY
+ * uplinks with no downlink : hours at our heartbeat rate. Acks missed by confirmed frames tell us sooner.
+ */
+static void lora_adr_fallback(void) 
+{
+    if (tpc_dbm()<_loraCfg.txPower) 
+    {
+        lora_tpc_set(_loraCfg.txPower);
+        return;
+    }
+    MibRequestConfirm_t mib;
+    uint8_t dr = lora_current_dr();
+    if (dr>0) 
+    {
+        mib.Type = MIB_CHANNELS_DATARATE;
+        mib.Param.ChannelsDatarate = dr-1;
+        if (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK) 
+        {
+            console_printf("lora acks missed at DR%d, down to DR%d\r\n", dr, dr-1);
+        }
+    }
+}
+
+static void lora_link_result(uint8_t dr, bool acked, int8_t snr) 
+{
+    lora_lq_add(dr, acked, snr);
+    if (acked) 
+    {
+        if (_link.missed>=LINKCHECK_MAX_MISSES) 
+        {
+            console_printf("lora link back\r\n");
+        }
+        _link.missed = 0;
+        return;
+    }
+    if (_link.missed<UINT8_MAX) 
+    {
+        _link.missed++;
+    }
+    if (_loraCfg.useAdr) 
+    {
+        if (_link.missed>=ADR_FALLBACK_MISSES) 
+        {
+            lora_adr_fallback();
+        }
+    } 
+    else 
+    {
+        // louder, and full power once the link is lost
+        lora_tpc_set(tpc_missed(_link.missed>=LINKCHECK_MAX_MISSES));
+    }
+    if (_link.missed==LINKCHECK_MAX_MISSES) 
+    {
+        console_printf("lora link lost : %d confirmed frames not acked\r\n", _link.missed);
+        // maybe the network lost our session, don't trust it after a reboot
+        lorasess_forget();
+    }
+}
+
+static uint32_t lora_uplink_counter(void) 
+{
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_UPLINK_COUNTER;
+    if (LoRaMacMibGetRequestConfirm(&mib)!=LORAMAC_STATUS_OK) 
+    {
+        return 0;
+    }
+    return mib.Param.UpLinkCounter;
+}
 
-    /* Send a frame*/
-    /* 
-     * 3rd action: put the data into the queue, the message will be sent
-     * when the LoRaWAN stack is ready. 
-     */
-    int ret = lorawan_send(_sock_tx, _loraCfg.txPort, _txBuffer, sz);
+// Give the result to the app if it wants it, and the block back to the queue pool (the stack is done with the data)
+static void lora_tx_done(struct lora_txq_entry* tx, LORA_TX_RES_t* res) 
+{
+    res->frameId = tx->id;
+    if (tx->notify) 
+    {
+        (*_txcbfn)(res);
+    }
+    os_memblock_put(&_txqPool, tx);
+}
+
+// Send one frame from the queue and wait for its result. Returns it : if it went, a downlink may have come.
+static LORA_TX_RESULT_t loraapp_tx(struct lora_txq_entry* tx) 
+{
+    LORA_TX_RES_t res = { .result = LORA_TX_ERR_RETRY, .acked = false, .rssi = LORA_RSSI_UNKNOWN, .snr = 0 };
+    console_printf("TX thread started\r\n");  
+    bool confirmed = lora_policy_confirmed(tx->cls);
+    lora_set_confirmed(confirmed);
+    // the uplink counter is checkpointed before it is used
+    lorasess_check();
+    res.fcnt = lora_uplink_counter();
+    res.dr = lora_current_dr();
+    res.toaMs = airtime_toa_ms(res.dr, tx->sz);
+    // the network may have changed it
+    tpc_set(lora_current_txpower());
+    res.txPowerDbm = tpc_dbm();
+    res.txmA = airtime_tx_ma(tpc_dbm());
+    int ret = lorawan_send(_sock_tx, tx->port, tx->data, tx->sz);
     switch(ret) 
     {
         case LORAWAN_STATUS_OK: 
         {
             console_printf("LoRaWAN API tx queued ok [with devAddr:%08lx]\r\n",
                 lorawan_get_devAddr_unicast() );
-            // release the task to wait for result if cb required
-            if (timeoutMs!=0) 
-            {
-                os_sem_release(&_lora_tx_sem);
-            }
-            return LORA_TX_OK;
+            break;
         }
         case LORAWAN_STATUS_PORT_BUSY: 
         {
+            // try again in a bit, app does not need to know
             console_printf("LoRaWAN API tx has busy return code. \r\n");
+            lora_txq_putback(tx);
+            os_time_delay(OS_TICKS_PER_SEC);
             return LORA_TX_ERR_RETRY;
         }
         default: 
         {
             console_printf("LoRaWAN API tx has fatal error code (%d). \r\n",
                 ret);
-            return LORA_TX_ERR_FATAL;       // best you reset mate
+            res.result = LORA_TX_ERR_FATAL;       // best you reset mate
+            lora_tx_done(tx, &res);
+            return res.result;
+        }
+    }
+    airtime_account(confirmed?(res.toaMs*LORA_NB_TRIALS):res.toaMs);
+    console_printf("send message (%s), wait state \r\n", confirmed?"confirmed":"unconfirmed");
+    // a confirmed frame is done when acked, SENT only says it went
+    lorawan_event_t txev = lorawan_wait_ev(_sock_tx, 
+        (LORAWAN_EVENT_ERROR|(confirmed?LORAWAN_EVENT_ACK:LORAWAN_EVENT_SENT)), 
+        (tx->timeoutMs!=LORA_TX_TIMEOUT_AUTO)?tx->timeoutMs:lora_tx_time_ms(res.dr, tx->sz, tx->cls));
+    console_printf("tx ev returns, event is %02x \r\n", txev);
+    if (txev == LORAWAN_EVENT_ACK) 
+    {
+        res.result = LORA_TX_OK_ACKD;
+        res.acked = true;
+        // the ack was the last packet the radio received
+        radiopkt_last(&res.rssi, &res.snr);
+        lora_tpc_margin(res.snr);
+    }
+    if (txev == LORAWAN_EVENT_SENT) 
+    {
+        res.result = LORA_TX_OK;
+    }
+    if (txev == LORAWAN_EVENT_NONE) 
+    {
+        // timeout (no ack if confirmed)
+        res.result = LORA_TX_TIMEOUT;
+    }
+    if (confirmed) 
+    {
+        lora_link_result(res.dr, res.acked, res.snr);
+    }
+    // this may have been the join
+    lorasess_check();
+    lora_tx_done(tx, &res);
+    return res.result;
+}
+
+/*
+ * Class A : a downlink can only come in the RX1/RX2 windows after an uplink, and the stack gives the tx 
+ * result once they are closed. So any downlink is already waiting in the socket, and a short poll gets it.
+ */
+static void loraapp_rx(bool acked) 
+{
+    uint32_t devAddr;
+    uint8_t port;
+    uint8_t* buf = os_memblock_get(&_rxPool);
+    if (buf==NULL) 
+    {
+        // the app still has them all, any downlink stays in the stack till next time
+        console_printf("lora rx : no free buffer\r\n");
+        return;
+    }
+    // int : an error is negative
+    int rxsz = lorawan_recv(_sock_rx, &devAddr, &port, buf, LORA_RX_BUF_SZ, LORA_RX_POLL_MS);
+    console_printf("lora rx says got [%d] bytes \r\n", rxsz);
+    if (rxsz<0) 
+    {
+        console_printf("lora rx error %d\r\n", rxsz);
+    } 
+    else if (rxsz>LORA_RX_BUF_SZ) 
+    {
+        // bigger than the buffer : what we have is cut, and a cut TLV list would be misread
+        console_printf("lora rx : %d bytes truncated to %d, dropped\r\n", rxsz, LORA_RX_BUF_SZ);
+        rxsz = 0;
+    }
+    if (rxsz>0) 
+    {
+        if (!acked) 
+        {
+            // else it came with the ack, whose margin was already taken
+            int16_t rssi;
+            int8_t snr;
+            radiopkt_last(&rssi, &snr);
+            lora_tpc_margin(snr);
         }
+        // it's theirs now
+        (*_rxcbfn)(port, buf, rxsz);
+    } 
+    else 
+    {
+        os_memblock_put(&_rxPool, buf);
     }
 }
 
+void lora_app_rx_free(void* data) 
+{
+    os_memblock_put(&_rxPool, data);
+}
+
 
 static void loraapp_task(void* data) 
 {
     while(1) 
     {
-        if (_sock_tx!=0) 
-        {
-            // TODO should have sema to stop app trying a tx before we're ready to go back to listen for tx result...
-            // but without blocking the tx caller.... just a flag?
-            _canTx = true;
-            // Wait till we tx something
-            os_sem_pend(&_lora_tx_sem, OS_TIMEOUT_NEVER);
-            _canTx = false;
-            console_printf("send message, wait state \r\n");
-            lorawan_event_t txev = lorawan_wait_ev(_sock_tx, (LORAWAN_EVENT_ERROR|LORAWAN_EVENT_SENT|LORAWAN_EVENT_ACK), _loraCfg.txTimeoutMs);
-            // note sema is now taken (==0), so next time round will block until a tx call adds a token
-            console_printf("tx ev returns, event is %02x \r\n", txev);
-            assert(_txcbfn!=NULL);      // must have a cb fn if we created the socket...
-            if (txev == LORAWAN_EVENT_ACK) 
-            {
-                (*_txcbfn)(LORA_TX_OK_ACKD);
-            }
-            if (txev == LORAWAN_EVENT_SENT) 
-            {
-                (*_txcbfn)(LORA_TX_OK);
-            }
-            if (txev == LORAWAN_EVENT_ERROR) 
-            {
-                (*_txcbfn)(LORA_TX_ERR_RETRY);
-            }
-            if (txev == LORAWAN_EVENT_NONE) 
-            {
-                // timeout
-                (*_txcbfn)(LORA_TX_TIMEOUT);
-            }
+        // If no tx socket open, nothing to send so nothing to receive, just wait
+        if (_sock_tx==0) 
+        {
+            os_time_delay(OS_TICKS_PER_SEC*60);
+            continue;
         }
-        
-        // TX done. try for an RX while we're here... 
-        if (_sock_rx!=0) 
-        {
-            uint32_t devAddr;
-            uint8_t port;
-            uint8_t payload[256];
-            assert(_rxcbfn!=NULL);      // Must have cb fn if created socket
-            // Wait 10s as gotta wait for RX2 delay (up to 7s) + SF12 (2s)
-            uint8_t rxsz = lorawan_recv(_sock_rx, &devAddr, &port, payload, 255, 9000);
-            console_printf("lora rx says got [%d] bytes \r\n", rxsz);
-            if (rxsz>0) 
-            {
-                (*_rxcbfn)(port, payload, rxsz);
-            }
+        uint32_t waitMs;
+        struct lora_txq_entry* tx = lora_txq_get(&waitMs);
+        if (tx==NULL) 
+        {
+            // Wait till there is something to tx, or till the duty cycle lets the head frame go.
+            // A frame queued meanwhile wakes us up, as an alarm may still fit in the reserve.
+            os_sem_pend(&_lora_tx_sem, (waitMs==0)?OS_TIMEOUT_NEVER:os_time_ms_to_ticks32(waitMs));
+            continue;
         }
-        
-        // If no socket open, then just wait
-        if (!(_sock_tx!=0 || _sock_rx!=0)) 
+        assert(_txcbfn!=NULL);      // must have a cb fn if we created the socket...
+        // No rx windows to look at if the tx failed
+        LORA_TX_RESULT_t res = loraapp_tx(tx);
+        if ((res==LORA_TX_OK || res==LORA_TX_OK_ACKD) && _sock_rx!=0) 
         {
-            os_time_delay(OS_TICKS_PER_SEC*60);
-        }  
-    
+            assert(_rxcbfn!=NULL);  // Must have cb fn if created socket
+            loraapp_rx(res==LORA_TX_OK_ACKD);
+        }
     }
 }
@@ -0,0 +1,181 @@
+/**
+ Wyres private code
+ Uplink aggregation : timestamped records waiting for the next frame.
+ */
+
+#include <string.h>
+
+#include "os/os.h"
+#include "console/console.h"
+
+#include "LoRa_message.h"
+#include "appcfg.h"
+#include "statemach.h"
+#include "smreplay.h"
+#include "aggreg.h"
+
+// Worst case added by one door event : a door and a battery record, and in redundant history mode its entry
+#define AGG_EVENT_BYTES     (4)
+#define AGG_HIST_EVENT_BYTES (2)
+
+static struct {
+    uint8_t kind;
+    int32_t value;
+    os_time_t ts;
+    uint16_t seq;           // in the journal, for the door records
+} _aggRecs[PL_MAX_RECORDS];
+static uint8_t _aggHead = 0;
+static uint8_t _aggCount = 0;
+static uint8_t _aggDropped = 0;         // dropped since the last fill
+static int32_t _aggLastBattQ = -1;      // coded value of the last battery record
+static struct {
+    uint8_t n;
+    uint16_t first;
+    uint16_t last;
+} _aggFillDoors;                        // door events in the last fill
+// The last door events, sent or not, for the redundant history
+static struct {
+    uint8_t door;
+    uint16_t seq;
+    os_time_t ts;
+} _aggHist[PL_MAX_HISTORY];
+static uint8_t _aggHistNext = 0;
+static uint8_t _aggHistCount = 0;
+
+void aggreg_init(void) {
+    _aggHead = 0;
+    _aggCount = 0;
+    _aggDropped = 0;
+    _aggLastBattQ = -1;
+    _aggFillDoors.n = 0;
+    _aggHistNext = 0;
+    _aggHistCount = 0;
+    // the records waiting decide when the next uplink goes, the history what it carries
+    smcapture_state(_aggRecs, sizeof(_aggRecs));
+    smcapture_state(&_aggHead, sizeof(_aggHead));
+    smcapture_state(&_aggCount, sizeof(_aggCount));
+    smcapture_state(&_aggDropped, sizeof(_aggDropped));
+    smcapture_state(&_aggLastBattQ, sizeof(_aggLastBattQ));
+    smcapture_state(_aggHist, sizeof(_aggHist));
+    smcapture_state(&_aggHistNext, sizeof(_aggHistNext));
+    smcapture_state(&_aggHistCount, sizeof(_aggHistCount));
+}
+
+static void aggreg_fill_hist(PAYLOAD_t* p, os_time_t now) {
+    uint8_t k = sm_cfg_get(APPCFG_HISTORY_EVENTS);
+    k = (k<_aggHistCount)?k:_aggHistCount;
+    for(uint8_t j=k;j>0;j--) {
+        uint8_t i = (_aggHistNext+PL_MAX_HISTORY-j)%PL_MAX_HISTORY;
+        payload_add_history(p, _aggHist[i].seq, _aggHist[i].door, os_time_ticks_to_ms32(now-_aggHist[i].ts)/1000);
+    }
+}
+
+static uint8_t aggreg_fill_recs(PAYLOAD_t* p) {
+    os_time_t now = os_time_get();
+    uint8_t n = 0;
+    aggreg_fill_hist(p, now);
+    for(;n<_aggCount;n++) {
+        uint8_t i = (_aggHead+n)%PL_MAX_RECORDS;
+        uint32_t ageSecs = os_time_ticks_to_ms32(now-_aggRecs[i].ts)/1000;
+        if (!payload_add_record(p, _aggRecs[i].kind, (ageSecs<UINT16_MAX)?ageSecs:UINT16_MAX, _aggRecs[i].value)) {
+            break;
+        }
+    }
+    return n;
+}
+
+// Would another event still fit in a frame at the current data rate?
+static bool aggreg_room(void) {
+    if ((_aggCount+2)>PL_MAX_RECORDS) {
+        return false;
+    }
+    PAYLOAD_t probe;
+    payload_init(&probe);
+    aggreg_fill_recs(&probe);
+    // the required fields count even if not set
+    uint8_t more = AGG_EVENT_BYTES + ((sm_cfg_get(APPCFG_HISTORY_EVENTS)>0)?AGG_HIST_EVENT_BYTES:0);
+    return ((payload_size(&probe)+more)<=SM_MAX_PAYLOAD());
+}
+
+bool aggreg_add(uint8_t kind, int32_t value, uint16_t seq) {
+    if (kind==PL_REC_BATTERY) {
+        // only worth a record if the receiver would see a different value
+        int32_t q = payload_quantize(PL_BATTERY, value);
+        if (q==_aggLastBattQ) {
+            return !aggreg_room();
+        }
+        _aggLastBattQ = q;
+    }
+    if (_aggCount>=PL_MAX_RECORDS) {
+        // should have been sent already : the oldest goes
+        console_printf("aggreg full, oldest record dropped\r\n");
+        _aggHead = (_aggHead+1)%PL_MAX_RECORDS;
+        _aggCount--;
+        _aggDropped++;
+    }
+    uint8_t i = (_aggHead+_aggCount)%PL_MAX_RECORDS;
+    _aggRecs[i].kind = kind;
+    _aggRecs[i].value = value;
+    _aggRecs[i].ts = os_time_get();
+    _aggRecs[i].seq = seq;
+    _aggCount++;
+    if (kind==PL_REC_DOOR) {
+        _aggHist[_aggHistNext].door = value;
+        _aggHist[_aggHistNext].seq = seq;
+        _aggHist[_aggHistNext].ts = _aggRecs[i].ts;
+        _aggHistNext = (_aggHistNext+1)%PL_MAX_HISTORY;
+        if (_aggHistCount<PL_MAX_HISTORY) {
+            _aggHistCount++;
+        }
+    }
+    return !aggreg_room();
+}
+
+uint8_t aggreg_count(void) {
+    return _aggCount;
+}
+
+uint8_t aggreg_fill(PAYLOAD_t* p) {
+    _aggDropped = 0;
+    uint8_t n = aggreg_fill_recs(p);
+    // history times grow coarser (longer) as they age : the oldest entries go if it no longer fits
+    while(p->nhist>0 && payload_size(p)>SM_MAX_PAYLOAD()) {
+        memmove(&p->hist[0], &p->hist[1], (p->nhist-1)*sizeof(p->hist[0]));
+        p->nhist--;
+    }
+    _aggFillDoors.n = 0;
+    for(uint8_t k=0;k<n;k++) {
+        uint8_t i = (_aggHead+k)%PL_MAX_RECORDS;
+        if (_aggRecs[i].kind==PL_REC_DOOR) {
+            if (_aggFillDoors.n++==0) {
+                _aggFillDoors.first = _aggRecs[i].seq;
+            }
+            _aggFillDoors.last = _aggRecs[i].seq;
+        }
+    }
+    if (p->nhist>0) {
+        // the history has the newest, and goes further back unless the records are more
+        uint16_t first = p->histSeq-(p->nhist-1);
+        if (_aggFillDoors.n==0 || (int16_t)(first-_aggFillDoors.first)<0) {
+            _aggFillDoors.first = first;
+        }
+        _aggFillDoors.last = p->histSeq;
+        _aggFillDoors.n = _aggFillDoors.last-_aggFillDoors.first+1;
+    }
+    return n;
+}
+
+uint8_t aggreg_filled_doors(uint16_t* first, uint16_t* last) {
+    *first = _aggFillDoors.first;
+    *last = _aggFillDoors.last;
+    return _aggFillDoors.n;
+}
+
+void aggreg_sent(uint8_t n) {
+    // records dropped since the fill were among those sent
+    n = (n>_aggDropped)?(n-_aggDropped):0;
+    n = (n<_aggCount)?n:_aggCount;
+    _aggHead = (_aggHead+n)%PL_MAX_RECORDS;
+    _aggCount -= n;
+    _aggDropped = 0;
+}
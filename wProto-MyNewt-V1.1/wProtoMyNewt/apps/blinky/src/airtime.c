@@ -0,0 +1,145 @@
+/**
+ Wyres private code
+ EU868 airtime and duty cycle accounting.
+ */
+
+#include "os/os.h"
+#include "console/console.h"
+
+#include "airtime.h"
+
+#define AIRTIME_BUDGET_MS       (3600ul*MYNEWT_VAL(AIRTIME_DUTY_CYCLE_PERMIL))     // per hour
+#define AIRTIME_RESERVE_MS      MYNEWT_VAL(AIRTIME_ALARM_RESERVE_MS)
+#define AIRTIME_NB_BUCKETS      (60)                                // one per minute
+#define LORAWAN_OVERHEAD        (13)                                // MHDR, FHDR (no FOpts), FPort, MIC
+#define LORAWAN_JOIN_REQ_SZ     (23)                                // MHDR, AppEUI, DevEUI, DevNonce, MIC
+
+/*
+ * Per DR LoRa modulation (EU868 DR0-6, 125kHz except DR6 250kHz, CR 4/5, explicit header, CRC on, 8 preamble
+ * symbols). toa = tsym*(12.25 + 8 + 5*ceil(max(8*PL - 4*SF + 44, 0) / (4*(SF - 2*LDRO)))), LDRO on for SF11/12 at 125kHz
+ */
+static const struct {
+    uint16_t tSymUs;
+    uint8_t sf;
+    uint8_t bitsPerBlock;       // 4*(SF-2*LDRO)
+} _drPhy[] = {
+    { 32768, 12, 40 },
+    { 16384, 11, 36 },
+    {  8192, 10, 40 },
+    {  4096,  9, 36 },
+    {  2048,  8, 32 },
+    {  1024,  7, 28 },
+    {   512,  7, 28 },
+};
+
+// Airtime (ms) used in each of the last minutes, _bucketMinute being the current one.
+// Changed by the sm task (queueing) and the lora task (sending) : under _airtimeMutex.
+static uint16_t _buckets[AIRTIME_NB_BUCKETS];
+static uint32_t _bucketMinute = 0;
+static struct os_mutex _airtimeMutex;
+
+void airtime_init(void) {
+    os_mutex_init(&_airtimeMutex);
+}
+
+static uint32_t airtime_phy_toa_ms(uint8_t dr, uint8_t phySz) {
+    if (dr>=(sizeof(_drPhy)/sizeof(_drPhy[0]))) {
+        dr = 0;
+    }
+    int32_t bits = 8*phySz - 4*_drPhy[dr].sf + 44;
+    uint32_t blocks = (bits>0)?((bits+_drPhy[dr].bitsPerBlock-1)/_drPhy[dr].bitsPerBlock):0;
+    // preamble 12.25 symbols, header 8, then 5 symbols per block
+    uint32_t us = (49*(uint32_t)_drPhy[dr].tSymUs)/4 + (8+5*blocks)*(uint32_t)_drPhy[dr].tSymUs;
+    return (us+999)/1000;
+}
+
+uint32_t airtime_toa_ms(uint8_t dr, uint8_t appSz) {
+    return airtime_phy_toa_ms(dr, appSz+LORAWAN_OVERHEAD);
+}
+
+uint32_t airtime_join_toa_ms(uint8_t dr) {
+    return airtime_phy_toa_ms(dr, LORAWAN_JOIN_REQ_SZ);
+}
+
+// SX1272 supply current (mA) when transmitting, by 2dB step down from 14dBm, on RFO :
+// datasheet 28mA at 13dBm and 18mA at 7dBm, the rest extrapolated
+static const uint8_t _txCurrentByStep[] = { 30, 26, 23, 20, 17, 16, 15, 14 };
+
+uint8_t airtime_tx_ma(int8_t dBm) {
+    int step = (14-dBm)/2;
+    if (step<0) {
+        step = 0;
+    }
+    if (step>=(int)sizeof(_txCurrentByStep)) {
+        step = sizeof(_txCurrentByStep)-1;
+    }
+    return _txCurrentByStep[step];
+}
+
+static uint32_t airtime_minute(void) {
+    return (uint32_t)(os_get_uptime_usec()/60000000);
+}
+
+// Move the window to the current minute, emptying the buckets it passed
+static void airtime_advance(void) {
+    uint32_t now = airtime_minute();
+    uint32_t n = now-_bucketMinute;
+    if (n>AIRTIME_NB_BUCKETS) {
+        n = AIRTIME_NB_BUCKETS;
+    }
+    for(uint32_t i=1;i<=n;i++) {
+        _buckets[(_bucketMinute+i)%AIRTIME_NB_BUCKETS] = 0;
+    }
+    _bucketMinute = now;
+}
+
+// Caller holds _airtimeMutex
+static uint32_t airtime_used_locked(void) {
+    airtime_advance();
+    uint32_t used = 0;
+    for(int i=0;i<AIRTIME_NB_BUCKETS;i++) {
+        used += _buckets[i];
+    }
+    return used;
+}
+
+uint32_t airtime_used_ms(void) {
+    os_mutex_pend(&_airtimeMutex, OS_TIMEOUT_NEVER);
+    uint32_t used = airtime_used_locked();
+    os_mutex_release(&_airtimeMutex);
+    return used;
+}
+
+uint32_t airtime_wait_ms(uint32_t toaMs, bool alarm) {
+    uint32_t limit = alarm?AIRTIME_BUDGET_MS:(AIRTIME_BUDGET_MS-AIRTIME_RESERVE_MS);
+    uint32_t wait = 0;
+    os_mutex_pend(&_airtimeMutex, OS_TIMEOUT_NEVER);
+    uint32_t used = airtime_used_locked();
+    if ((used+toaMs)>limit) {
+        if (toaMs>limit) {
+            // can never fit : send as soon as the hour is empty
+            limit = toaMs;
+        }
+        // the oldest minutes leave the window first
+        for(int i=1;i<=AIRTIME_NB_BUCKETS;i++) {
+            used -= _buckets[(_bucketMinute+i)%AIRTIME_NB_BUCKETS];
+            if ((used+toaMs)<=limit) {
+                // that minute leaves the window at the start of minute _bucketMinute+i
+                uint64_t at = (uint64_t)(_bucketMinute+i)*60000;
+                uint64_t nowMs = os_get_uptime_usec()/1000;
+                wait = (at>nowMs)?(uint32_t)(at-nowMs):0;
+                break;
+            }
+        }
+    }
+    os_mutex_release(&_airtimeMutex);
+    return wait;
+}
+
+void airtime_account(uint32_t toaMs) {
+    os_mutex_pend(&_airtimeMutex, OS_TIMEOUT_NEVER);
+    airtime_advance();
+    uint32_t b = _buckets[_bucketMinute%AIRTIME_NB_BUCKETS] + toaMs;
+    _buckets[_bucketMinute%AIRTIME_NB_BUCKETS] = (b<UINT16_MAX)?b:UINT16_MAX;
+    os_mutex_release(&_airtimeMutex);
+}
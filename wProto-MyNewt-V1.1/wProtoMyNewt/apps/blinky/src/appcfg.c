@@ -0,0 +1,179 @@
+/**
+ Wyres private code
+ Run time application parameters, saved with sys/config.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "os/os.h"
+#include "console/console.h"
+#include "config/config.h"
+
+#include "appcfg.h"
+
+typedef struct {
+    const char* key;
+    uint8_t id;
+    uint32_t min;
+    uint32_t max;
+    uint32_t def;
+} APPCFG_DESC_t;
+
+#define APPCFG_PARAM(n, k, i, mn, mx, d) [APPCFG_##n] = { .key = (k), .id = (i), .min = (mn), .max = (mx), .def = (d) },
+static const APPCFG_DESC_t _cfgDescs[APPCFG_NB] = {
+    APPCFG_PARAMS
+};
+#undef APPCFG_PARAM
+
+// Read from any task, only written (whole words) by appcfg_set() or at load
+static uint32_t _cfgValues[APPCFG_NB];
+
+#define APPCFG_NAME_SZ  (16)
+
+// Saving goes to the default event queue (main task) : the FCB writes need more stack than the tasks setting
+// values may have (a downlink command is applied on the lora task)
+static uint32_t _savePending;       // APPCFG_BIT()s
+static void appcfg_save_ev(struct os_event* ev);
+static struct os_event _saveEv = {
+    .ev_cb = appcfg_save_ev,
+};
+
+static char* appcfg_conf_get(int argc, char** argv, char* val, int val_len_max);
+static int appcfg_conf_set(int argc, char** argv, char* val);
+static int appcfg_conf_export(void (*export_func)(char* name, char* val), enum conf_export_tgt tgt);
+
+static struct conf_handler _cfgHandler = {
+    .ch_name = "app",
+    .ch_get = appcfg_conf_get,
+    .ch_set = appcfg_conf_set,
+    .ch_commit = NULL,
+    .ch_export = appcfg_conf_export,
+};
+
+static APPCFG_ID_t appcfg_find_key(const char* key) {
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        if (strcmp(_cfgDescs[p].key, key)==0) {
+            return (APPCFG_ID_t)p;
+        }
+    }
+    return APPCFG_NONE;
+}
+
+static bool appcfg_valid(APPCFG_ID_t p, uint32_t v) {
+    return (v>=_cfgDescs[p].min && v<=_cfgDescs[p].max);
+}
+
+static char* appcfg_conf_get(int argc, char** argv, char* val, int val_len_max) {
+    APPCFG_ID_t p = (argc==1)?appcfg_find_key(argv[0]):APPCFG_NONE;
+    if (p==APPCFG_NONE) {
+        return NULL;
+    }
+    int32_t v = _cfgValues[p];
+    return conf_str_from_value(CONF_INT32, &v, val, val_len_max);
+}
+
+// Loading the saved values
+static int appcfg_conf_set(int argc, char** argv, char* val) {
+    APPCFG_ID_t p = (argc==1)?appcfg_find_key(argv[0]):APPCFG_NONE;
+    int32_t v;
+    if (p==APPCFG_NONE) {
+        return OS_ENOENT;
+    }
+    if (conf_value_from_str(val, CONF_INT32, &v, sizeof(v))!=0 || !appcfg_valid(p, v)) {
+        // keep the default
+        return OS_EINVAL;
+    }
+    _cfgValues[p] = v;
+    return 0;
+}
+
+static int appcfg_conf_export(void (*export_func)(char* name, char* val), enum conf_export_tgt tgt) {
+    char name[APPCFG_NAME_SZ];
+    char str[12];
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        int32_t v = _cfgValues[p];
+        snprintf(name, sizeof(name), "app/%s", _cfgDescs[p].key);
+        (*export_func)(name, conf_str_from_value(CONF_INT32, &v, str, sizeof(str)));
+    }
+    return 0;
+}
+
+static void appcfg_save_ev(struct os_event* ev) {
+    char name[APPCFG_NAME_SZ];
+    char str[12];
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    uint32_t pending = _savePending;
+    _savePending = 0;
+    OS_EXIT_CRITICAL(sr);
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        if ((pending & APPCFG_BIT(p))==0) {
+            continue;
+        }
+        int32_t v = _cfgValues[p];
+        snprintf(name, sizeof(name), "app/%s", _cfgDescs[p].key);
+        if (conf_save_one(name, conf_str_from_value(CONF_INT32, &v, str, sizeof(str)))!=0) {
+            console_printf("appcfg : failed to save %s\r\n", name);
+        }
+    }
+}
+
+// Have the current value saved soon
+static void appcfg_save(APPCFG_ID_t p) {
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _savePending |= APPCFG_BIT(p);
+    OS_EXIT_CRITICAL(sr);
+    os_eventq_put(os_eventq_dflt_get(), &_saveEv);
+}
+
+void appcfg_init(void) {
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        _cfgValues[p] = _cfgDescs[p].def;
+    }
+    int rc = conf_register(&_cfgHandler);
+    assert(rc==0);
+    // saved values replace the defaults
+    conf_load();
+}
+
+uint32_t appcfg_get(APPCFG_ID_t p) {
+    assert(p>APPCFG_NONE && p<APPCFG_NB);
+    return _cfgValues[p];
+}
+
+bool appcfg_set(APPCFG_ID_t p, uint32_t v) {
+    assert(p>APPCFG_NONE && p<APPCFG_NB);
+    if (!appcfg_valid(p, v)) {
+        console_printf("appcfg : %s=%lu out of [%lu,%lu]\r\n", _cfgDescs[p].key, (unsigned long)v, (unsigned long)_cfgDescs[p].min, (unsigned long)_cfgDescs[p].max);
+        return false;
+    }
+    if (_cfgValues[p]!=v) {
+        _cfgValues[p] = v;
+        appcfg_save(p);
+        console_printf("appcfg : %s=%lu\r\n", _cfgDescs[p].key, (unsigned long)v);
+    }
+    return true;
+}
+
+uint32_t appcfg_reset(void) {
+    uint32_t changed = 0;
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        if (_cfgValues[p]!=_cfgDescs[p].def) {
+            appcfg_set((APPCFG_ID_t)p, _cfgDescs[p].def);
+            changed |= APPCFG_BIT(p);
+        }
+    }
+    return changed;
+}
+
+APPCFG_ID_t appcfg_find(uint8_t id) {
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) {
+        if (_cfgDescs[p].id==id) {
+            return (APPCFG_ID_t)p;
+        }
+    }
+    return APPCFG_NONE;
+}
@@ -0,0 +1,54 @@
+/**
+ Wyres private code
+ Downlink command processing : TLVs parsed in the rx buffer, no copy.
+ */
+
+#include "os/os.h"
+#include "console/console.h"
+
+#include "appcfg.h"
+#include "smstats.h"
+#include "dlcmd.h"
+
+static uint32_t dlcmd_cfg(uint8_t type, const uint8_t* v, uint8_t len) {
+    APPCFG_ID_t p = appcfg_find(type);
+    if (p==APPCFG_NONE || len==0 || len>4) {
+        console_printf("dlcmd : bad cfg tlv %02x len %d\r\n", type, len);
+        return 0;
+    }
+    uint32_t val = 0;
+    for(int i=0;i<len;i++) {
+        val = (val<<8) | v[i];
+    }
+    uint32_t old = appcfg_get(p);
+    if (!appcfg_set(p, val) || old==val) {
+        return 0;
+    }
+    return APPCFG_BIT(p);
+}
+
+uint32_t dlcmd_process(const uint8_t* data, uint8_t sz) {
+    uint32_t changed = 0;
+    uint8_t i = 0;
+    while ((i+2)<=sz) {
+        uint8_t type = data[i];
+        uint8_t len = data[i+1];
+        const uint8_t* v = &data[i+2];
+        if ((i+2+len)>sz) {
+            console_printf("dlcmd : truncated tlv %02x\r\n", type);
+            break;
+        }
+        if (type<=DLCMD_CFG_MAX_ID) {
+            changed |= dlcmd_cfg(type, v, len);
+        } else if (type==DLCMD_CFG_DEFAULTS) {
+            changed |= appcfg_reset();
+        } else if (type==DLCMD_DIAG) {
+            // sent from the default event queue, not from the rx callback
+            smstats_diag_request();
+        } else {
+            console_printf("dlcmd : unknown tlv %02x\r\n", type);
+        }
+        i += 2+len;
+    }
+    return changed;
+}
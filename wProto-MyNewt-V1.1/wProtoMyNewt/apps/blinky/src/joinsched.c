@@ -0,0 +1,85 @@
+/**
+ Wyres private code
+ Join attempt scheduling : random start, exponential backoff, join duty cycle.
+ */
+
+#include "os/os.h"
+
+#include "airtime.h"
+#include "joinsched.h"
+
+#define JOIN_FIRST_MAX_MS       MYNEWT_VAL(JOIN_FIRST_DELAY_MAX_MS)
+#define JOIN_BACKOFF_MIN_MS     MYNEWT_VAL(JOIN_BACKOFF_MIN_MS)
+#define JOIN_BACKOFF_MAX_MS     MYNEWT_VAL(JOIN_BACKOFF_MAX_MS)
+
+// LoRaWAN join request duty cycle since power up, as 1/ratio (the 8.7s/24h of the last period rounded down)
+static const struct {
+    uint32_t untilS;
+    uint16_t ratio;
+} _joinCaps[] = {
+    { 3600, 100 },
+    { 11*3600, 1000 },
+    { UINT32_MAX, 10000 },
+};
+
+static uint32_t _rnd = 1;
+static uint8_t _attempts = 0;
+
+// xorshift32 : no libc state, the same sequence on the target and in a host simulation
+static uint32_t joinsched_rand(uint32_t max) {
+    _rnd ^= _rnd << 13;
+    _rnd ^= _rnd >> 17;
+    _rnd ^= _rnd << 5;
+    return (max==UINT32_MAX)?_rnd:(_rnd % (max+1));
+}
+
+static uint16_t joinsched_ratio(uint32_t atS) {
+    int i = 0;
+    while(atS>=_joinCaps[i].untilS) {
+        i++;
+    }
+    return _joinCaps[i].ratio;
+}
+
+void joinsched_init(uint32_t seed) {
+    _rnd = (seed!=0)?seed:1;
+    _attempts = 0;
+    // let the seed spread before the first draw
+    for(int i=0;i<8;i++) {
+        joinsched_rand(UINT32_MAX);
+    }
+}
+
+uint32_t joinsched_next_ms(void) {
+    uint32_t delay;
+    if (_attempts==0) {
+        // spread the nodes that powered up together
+        delay = joinsched_rand(JOIN_FIRST_MAX_MS);
+    } else {
+        uint32_t base = JOIN_BACKOFF_MIN_MS;
+        for(int i=1;i<_attempts && base<JOIN_BACKOFF_MAX_MS;i++) {
+            base *= 2;
+        }
+        if (base>JOIN_BACKOFF_MAX_MS) {
+            base = JOIN_BACKOFF_MAX_MS;
+        }
+        // anywhere in the upper half, so two nodes that collided are unlikely to again
+        delay = base/2 + joinsched_rand(base/2);
+    }
+    if (_attempts>0) {
+        // the last request (at SF12 at worst) must be paid for at the rate of the period we send the next one in
+        uint32_t atS = (uint32_t)(os_get_uptime_usec()/1000000) + delay/1000;
+        uint32_t minMs = airtime_join_toa_ms(0)*joinsched_ratio(atS);
+        if (delay<minMs) {
+            delay = minMs;
+        }
+    }
+    if (_attempts<UINT8_MAX) {
+        _attempts++;
+    }
+    return delay;
+}
+
+void joinsched_joined(void) {
+    _attempts = 0;
+}
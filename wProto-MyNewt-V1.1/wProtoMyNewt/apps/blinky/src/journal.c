@@ -0,0 +1,387 @@
+/**
+ Wyres private code
+ Door event journal : append only ring of records in flash, the backlog drained in packed frames.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "os/os.h"
+#include "console/console.h"
+#include "crc/crc8.h"
+#include "flash_map/flash_map.h"
+#include "sysflash/sysflash.h"
+
+#include "journal.h"
+
+#define JN_BLOCK_SZ         MYNEWT_VAL(JOURNAL_BLOCK_SIZE)
+#define JN_STALE_MS         MYNEWT_VAL(JOURNAL_DRAIN_STALE_MS)
+#define JN_REC_SZ           (8)
+#define JN_SLOTS_PER_BLOCK  (JN_BLOCK_SZ/JN_REC_SZ)
+#define JN_EV_SZ            (4)                             // event varint, zero padded
+#define JN_EV_MAX           ((1UL<<(7*JN_EV_SZ))-1)
+#define JN_FRAME_SZ         (LORA_DIAG_MAX_SZ)              // fits every DR
+#define JN_HDR_MAX          (1+3+JN_EV_SZ)                  // version, seq, age
+
+#define JN_MAGIC_EVENT      (0xa5)
+#define JN_MAGIC_DRAINED    (0x5a)      // seq is the last event the network has
+// jn_read() results that are not a magic
+#define JN_SLOT_ERASED      (0)
+#define JN_SLOT_BAD         (1)         // torn write : counts as written, holds nothing
+
+#if (JN_BLOCK_SZ % JN_REC_SZ)!=0
+#error "JOURNAL_BLOCK_SIZE must be a multiple of 8"
+#endif
+
+// One record a flash slot. The event is stored as it is sent.
+typedef struct {
+    uint8_t magic;
+    uint8_t seq[2];
+    uint8_t ev[JN_EV_SZ];
+    uint8_t crc;            // over the bytes before
+} JN_REC_t;
+
+static struct {
+    const struct flash_area* fa;    // NULL if the journal is off
+    uint16_t nslots;
+    uint16_t head;          // next slot written : the blocks after it up to the next one are erased
+    uint16_t nextSeq;
+    uint16_t drained;       // last event the network has
+    bool lastThisBoot;      // the last event was added since boot, at lastSecs
+    uint32_t lastSecs;
+    uint8_t txId;           // backlog frame on its way (0 if none), with the events up to txLast
+    uint16_t txLast;
+    os_time_t txTs;
+} _jn;
+static struct os_mutex _jnMutex;
+static uint8_t _jnFrame[JN_FRAME_SZ];
+static uint8_t _jnEvs[JN_FRAME_SZ];
+
+static uint8_t jn_varint_put(uint8_t* b, uint32_t v) {
+    uint8_t n = 0;
+    while(v>=0x80) {
+        b[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b[n++] = v;
+    return n;
+}
+static uint8_t jn_varint_get(const uint8_t* b, uint8_t max, uint32_t* v) {
+    *v = 0;
+    for(uint8_t n=0;n<max;n++) {
+        *v |= (uint32_t)(b[n] & 0x7f)<<(7*n);
+        if ((b[n] & 0x80)==0) {
+            return n+1;
+        }
+    }
+    return max;
+}
+
+// Sequence numbers wrap : a is after b if less than half the range ahead
+static bool jn_seq_after(uint16_t a, uint16_t b) {
+    return (int16_t)(a-b)>0;
+}
+
+static uint32_t jn_now_secs(void) {
+    return os_get_uptime_usec()/1000000;
+}
+
+static uint8_t jn_crc(const JN_REC_t* r) {
+    return crc8_calc(crc8_init(), (void*)r, JN_REC_SZ-1);
+}
+static uint16_t jn_seq(const JN_REC_t* r) {
+    return r->seq[0] | (r->seq[1]<<8);
+}
+
+// Returns the magic of a valid record, JN_SLOT_ERASED or JN_SLOT_BAD
+static uint8_t jn_read(uint16_t slot, JN_REC_t* r) {
+    if (flash_area_read(_jn.fa, slot*JN_REC_SZ, r, JN_REC_SZ)!=0) {
+        return JN_SLOT_BAD;
+    }
+    // whatever the erased value of the flash is
+    const uint8_t* b = (const uint8_t*)r;
+    bool same = true;
+    for(int i=1;i<JN_REC_SZ && same;i++) {
+        same = (b[i]==b[0]);
+    }
+    if (same && (b[0]==0x00 || b[0]==0xff)) {
+        return JN_SLOT_ERASED;
+    }
+    if ((r->magic!=JN_MAGIC_EVENT && r->magic!=JN_MAGIC_DRAINED) || r->crc!=jn_crc(r)) {
+        return JN_SLOT_BAD;
+    }
+    return r->magic;
+}
+
+static uint16_t jn_next_block(uint16_t slot) {
+    return ((slot/JN_SLOTS_PER_BLOCK+1)*JN_SLOTS_PER_BLOCK) % _jn.nslots;
+}
+static void jn_erase_block(uint16_t slot) {
+    uint16_t first = slot - (slot%JN_SLOTS_PER_BLOCK);
+    if (flash_area_erase(_jn.fa, first*JN_REC_SZ, JN_BLOCK_SZ)!=0) {
+        console_printf("journal erase failed at %d\r\n", first);
+    }
+}
+// Are the slots from..to-1 all erased?
+static bool jn_erased(uint16_t from, uint16_t to) {
+    JN_REC_t r;
+    for(uint16_t s=from;s<to;s++) {
+        if (jn_read(s, &r)!=JN_SLOT_ERASED) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void jn_put(uint8_t magic, uint16_t seq, const uint8_t* ev) {
+    JN_REC_t r;
+    memset(&r, 0, sizeof(r));
+    r.magic = magic;
+    r.seq[0] = seq & 0xff;
+    r.seq[1] = seq>>8;
+    if (ev!=NULL) {
+        memcpy(r.ev, ev, JN_EV_SZ);
+    }
+    r.crc = jn_crc(&r);
+    if (flash_area_write(_jn.fa, _jn.head*JN_REC_SZ, &r, JN_REC_SZ)!=0) {
+        console_printf("journal write failed at %d\r\n", _jn.head);
+    }
+    _jn.head = (_jn.head+1)%_jn.nslots;
+}
+static void jn_append(uint8_t magic, uint16_t seq, const uint8_t* ev) {
+    if ((_jn.head%JN_SLOTS_PER_BLOCK)==0) {
+        // entering a block : the next one is erased now, one block of writes ahead (it holds the oldest records)
+        jn_erase_block(jn_next_block(_jn.head));
+        // and each block starts with the watermark, so erasing the oldest never loses it
+        jn_put(JN_MAGIC_DRAINED, _jn.drained, NULL);
+        if (magic==JN_MAGIC_DRAINED) {
+            return;
+        }
+    }
+    jn_put(magic, seq, ev);
+}
+static void jn_set_drained(uint16_t seq) {
+    _jn.drained = seq;
+    jn_append(JN_MAGIC_DRAINED, seq, NULL);
+}
+
+// Find where the writes go on : after the newest event (or marker if none), with the rest of its block and the
+// next one erased
+static void jn_find_head(void) {
+    JN_REC_t r;
+    bool any = false;
+    uint16_t newest = 0;
+    uint16_t newestSlot = 0;
+    uint16_t firstFree = _jn.nslots;
+    bool prevErased = (jn_read(_jn.nslots-1, &r)==JN_SLOT_ERASED);
+    for(uint16_t s=0;s<_jn.nslots;s++) {
+        uint8_t m = jn_read(s, &r);
+        if (m==JN_MAGIC_EVENT && (!any || jn_seq_after(jn_seq(&r), newest))) {
+            any = true;
+            newest = jn_seq(&r);
+            newestSlot = s;
+        }
+        if (m==JN_SLOT_ERASED && !prevErased && firstFree==_jn.nslots) {
+            firstFree = s;
+        }
+        prevErased = (m==JN_SLOT_ERASED);
+    }
+    _jn.head = (firstFree<_jn.nslots)?firstFree:0;
+    if (any) {
+        _jn.head = (newestSlot+1)%_jn.nslots;
+        for(uint16_t k=1;k<_jn.nslots;k++) {
+            uint16_t s = (newestSlot+k)%_jn.nslots;
+            if (jn_read(s, &r)==JN_SLOT_ERASED) {
+                _jn.head = s;
+                break;
+            }
+        }
+    }
+    // a write or an erase cut short by a reset may have left it otherwise
+    uint16_t next = jn_next_block(_jn.head);
+    uint16_t blockEnd = (next==0)?_jn.nslots:next;
+    if (!jn_erased(_jn.head, blockEnd)) {
+        // start afresh in the next block
+        _jn.head = next;
+        jn_erase_block(next);
+    } else if ((_jn.head%JN_SLOTS_PER_BLOCK)!=0 && !jn_erased(next, next+JN_SLOTS_PER_BLOCK)) {
+        jn_erase_block(next);
+    }
+}
+
+void journal_init(void) {
+    os_mutex_init(&_jnMutex);
+    memset(&_jn, 0, sizeof(_jn));
+#ifdef FLASH_AREA_JOURNAL
+    if (flash_area_open(FLASH_AREA_JOURNAL, &_jn.fa)!=0) {
+        _jn.fa = NULL;
+    }
+#endif
+    if (_jn.fa==NULL) {
+        // e.g. a BSP without the area (the native sim) : the app runs without the journal
+        console_printf("journal : no flash area, door events are not kept\r\n");
+        return;
+    }
+    _jn.nslots = (_jn.fa->fa_size/JN_BLOCK_SZ)*JN_SLOTS_PER_BLOCK;
+    // one being written, one erased ahead, at least one of history
+    assert(_jn.nslots>=3*JN_SLOTS_PER_BLOCK);
+    jn_find_head();
+    // then go through it oldest first
+    JN_REC_t r;
+    bool marker = false;
+    bool event = false;
+    uint16_t first = 0;
+    for(uint16_t k=0;k<_jn.nslots;k++) {
+        uint8_t m = jn_read((_jn.head+k)%_jn.nslots, &r);
+        if (m==JN_MAGIC_EVENT) {
+            if (!event) {
+                first = jn_seq(&r);
+                event = true;
+            }
+            _jn.nextSeq = jn_seq(&r)+1;
+        } else if (m==JN_MAGIC_DRAINED) {
+            _jn.drained = jn_seq(&r);
+            marker = true;
+        }
+    }
+    if (!marker) {
+        _jn.drained = event?(uint16_t)(first-1):(uint16_t)(_jn.nextSeq-1);
+    }
+    if (!event) {
+        // go on with the numbering the network saw
+        _jn.nextSeq = _jn.drained+1;
+    }
+    console_printf("journal : %d slots, head %d, next seq %d, backlog %d\r\n", _jn.nslots, _jn.head, _jn.nextSeq, journal_backlog());
+}
+
+uint16_t journal_add(uint8_t door) {
+    os_mutex_pend(&_jnMutex, OS_TIMEOUT_NEVER);
+    uint32_t now = jn_now_secs();
+    uint16_t seq = _jn.nextSeq++;
+    if (_jn.fa!=NULL) {
+        // from the event before, or from boot for the first one since
+        uint32_t delta = _jn.lastThisBoot?(now-_jn.lastSecs):now;
+        if (delta>(JN_EV_MAX>>2)) {
+            delta = JN_EV_MAX>>2;
+        }
+        uint8_t ev[JN_EV_SZ];
+        memset(ev, 0, sizeof(ev));
+        jn_varint_put(ev, (delta<<2) | ((_jn.lastThisBoot?0:1)<<1) | (door?1:0));
+        jn_append(JN_MAGIC_EVENT, seq, ev);
+    }
+    _jn.lastThisBoot = true;
+    _jn.lastSecs = now;
+    os_mutex_release(&_jnMutex);
+    return seq;
+}
+
+void journal_delivered(uint16_t first, uint16_t last) {
+    os_mutex_pend(&_jnMutex, OS_TIMEOUT_NEVER);
+    // only if nothing before them is missing : else the backlog frames will send them (again)
+    if (_jn.fa!=NULL && first==(uint16_t)(_jn.drained+1) && !jn_seq_after(first, last) && jn_seq_after(_jn.nextSeq, last)) {
+        jn_set_drained(last);
+    }
+    os_mutex_release(&_jnMutex);
+}
+
+// Queue a frame with the oldest events not acked, as many as fit at the current DR
+static void jn_send(void) {
+    uint8_t max = lora_app_max_payload();
+    max = (max<JN_FRAME_SZ)?max:JN_FRAME_SZ;
+    uint8_t evSz = 0;
+    uint8_t n = 0;
+    uint16_t first = 0;
+    uint16_t last = 0;
+    bool full = false;
+    // the age of the last event in the frame is the time since the newest event, plus the deltas in between
+    bool ageKnown = _jn.lastThisBoot;
+    uint32_t age = 0;
+    JN_REC_t r;
+    for(uint16_t k=0;k<_jn.nslots;k++) {
+        if (jn_read((_jn.head+k)%_jn.nslots, &r)!=JN_MAGIC_EVENT || !jn_seq_after(jn_seq(&r), _jn.drained)) {
+            continue;
+        }
+        uint32_t v;
+        uint8_t sz = jn_varint_get(r.ev, JN_EV_SZ, &v);
+        if (!full && (n==0 || jn_seq(&r)==(uint16_t)(last+1)) && (evSz+sz)<=(max-JN_HDR_MAX)) {
+            if (n==0) {
+                first = jn_seq(&r);
+            }
+            memcpy(&_jnEvs[evSz], r.ev, sz);
+            evSz += sz;
+            last = jn_seq(&r);
+            n++;
+            continue;
+        }
+        full = true;
+        if (v & 0x02) {
+            // a reboot since
+            ageKnown = false;
+        }
+        age += v>>2;
+    }
+    if (n==0) {
+        console_printf("journal : %d events overwritten before they were sent\r\n", journal_backlog());
+        jn_set_drained(_jn.nextSeq-1);
+        return;
+    }
+    age += jn_now_secs()-_jn.lastSecs;
+    uint8_t sz = 0;
+    _jnFrame[sz++] = JOURNAL_FRAME_VERSION;
+    sz += jn_varint_put(&_jnFrame[sz], first);
+    sz += jn_varint_put(&_jnFrame[sz], ageKnown?((age<JN_EV_MAX)?(age+1):JN_EV_MAX):0);
+    memcpy(&_jnFrame[sz], _jnEvs, evSz);
+    sz += evSz;
+    uint8_t id = 0;
+    if (lora_app_tx_backlog(_jnFrame, sz, &id)==LORA_TX_OK) {
+        _jn.txId = id;
+        _jn.txLast = last;
+        _jn.txTs = os_time_get();
+        console_printf("backlog frame %d : events %d to %d, %d bytes\r\n", id, first, last, sz);
+    }
+}
+
+static bool jn_in_flight(void) {
+    if (_jn.txId==0) {
+        return false;
+    }
+    if ((os_time_get()-_jn.txTs)>os_time_ms_to_ticks32(JN_STALE_MS)) {
+        // dropped from the tx queue for higher priority frames, it will get no result
+        console_printf("backlog frame %d lost\r\n", _jn.txId);
+        _jn.txId = 0;
+        return false;
+    }
+    return true;
+}
+
+void journal_drain(void) {
+    os_mutex_pend(&_jnMutex, OS_TIMEOUT_NEVER);
+    if (_jn.fa!=NULL && !jn_in_flight() && jn_seq_after(_jn.nextSeq-1, _jn.drained)) {
+        jn_send();
+    }
+    os_mutex_release(&_jnMutex);
+}
+
+bool journal_tx_result(const LORA_TX_RES_t* res) {
+    os_mutex_pend(&_jnMutex, OS_TIMEOUT_NEVER);
+    bool mine = (_jn.txId!=0 && res->frameId==_jn.txId);
+    if (mine) {
+        _jn.txId = 0;
+        if (res->result==LORA_TX_OK_ACKD) {
+            if (jn_seq_after(_jn.txLast, _jn.drained)) {
+                jn_set_drained(_jn.txLast);
+            }
+            // the link is there : on with the rest
+            if (jn_seq_after(_jn.nextSeq-1, _jn.drained)) {
+                jn_send();
+            }
+        }
+        // else it waits for the link to be seen back
+    }
+    os_mutex_release(&_jnMutex);
+    return mine;
+}
+
+uint16_t journal_backlog(void) {
+    return _jn.nextSeq-1-_jn.drained;
+}
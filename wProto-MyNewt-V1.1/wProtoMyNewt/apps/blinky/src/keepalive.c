@@ -0,0 +1,76 @@
+/**
+ Wyres private code
+ Keepalive scheduling : heartbeats skipped while nothing moves and the link is known good.
+ */
+
+#include "os/os.h"
+#include "console/console.h"
+
+#include "payload.h"
+#include "appcfg.h"
+#include "statemach.h"
+#include "smreplay.h"
+#include "keepalive.h"
+
+#define KA_BATT_STEPS       MYNEWT_VAL(KEEPALIVE_BATT_STEPS)
+
+static struct {
+    uint32_t ticks;         // since the last uplink
+    uint32_t sinceAck;      // ticks since the last acked uplink
+    uint32_t interval;      // ticks
+    int32_t refBattQ;       // coded battery at the start of the stable run, -1 if none
+} _ka;
+
+// A duration in heartbeat ticks (at least one)
+static uint32_t keepalive_ticks(APPCFG_ID_t p) {
+    uint32_t t = sm_cfg_get(p)/sm_cfg_get(APPCFG_HEARTBEAT_MS);
+    return (t>0)?t:1;
+}
+
+static void keepalive_restart(void) {
+    _ka.interval = 1;
+}
+
+void keepalive_init(void) {
+    _ka.ticks = 0;
+    _ka.sinceAck = 0;
+    _ka.refBattQ = -1;
+    keepalive_restart();
+    // decides which heartbeats go
+    smcapture_state(&_ka, sizeof(_ka));
+}
+
+uint8_t keepalive_tick(void) {
+    _ka.ticks++;
+    _ka.sinceAck++;
+    if (_ka.sinceAck>=keepalive_ticks(APPCFG_KEEPALIVE_LINK_MS)) {
+        return KEEPALIVE_CHECK;
+    }
+    // the ceiling may have been lowered since
+    uint32_t max = keepalive_ticks(APPCFG_KEEPALIVE_MAX_MS);
+    if (_ka.ticks>=_ka.interval || _ka.ticks>=max) {
+        return KEEPALIVE_SEND;
+    }
+    return KEEPALIVE_SKIP;
+}
+
+void keepalive_uplink(uint16_t battMv, bool door, bool acked) {
+    int32_t q = payload_quantize(PL_BATTERY, battMv);
+    bool still = (!door && _ka.refBattQ>=0 && q>=(_ka.refBattQ-KA_BATT_STEPS) && q<=(_ka.refBattQ+KA_BATT_STEPS));
+    if (still) {
+        uint32_t max = keepalive_ticks(APPCFG_KEEPALIVE_MAX_MS);
+        _ka.interval = ((_ka.interval*2)<max)?(_ka.interval*2):max;
+    } else {
+        _ka.refBattQ = q;
+        keepalive_restart();
+    }
+    _ka.ticks = 0;
+    if (acked) {
+        _ka.sinceAck = 0;
+    }
+    console_printf("keepalive every %lu heartbeats\r\n", (unsigned long)_ka.interval);
+}
+
+void keepalive_failed(void) {
+    keepalive_restart();
+}
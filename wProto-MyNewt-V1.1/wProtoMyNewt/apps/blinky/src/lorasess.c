@@ -0,0 +1,266 @@
+/**
+ Wyres private code
+ LoRaWAN session saved in flash with sys/config.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "os/os.h"
+#include "console/console.h"
+#include "config/config.h"
+#include "LoRaMac.h"
+
+#include "lorasess.h"
+
+#define FCNT_GAP        MYNEWT_VAL(LORA_SESSION_FCNT_GAP)
+#define SKEY_SZ         (16)
+#define SESS_SZ         (4+4+2*SKEY_SZ)     // netId, devAddr, nwkSKey, appSKey
+#define SESS_STR_SZ     (2*SESS_SZ+1)
+#define FCNT_STR_SZ     (24)
+// the checkpoint is saved this many frames before the last one it covers, as the save comes a bit later
+#define FCNT_SAVE_AHEAD (FCNT_GAP/4)
+
+#define SAVE_KEYS       (1<<0)
+#define SAVE_FCNT       (1<<1)
+
+typedef struct {
+    bool valid;
+    uint32_t netId;
+    uint32_t devAddr;
+    uint8_t nwkSKey[SKEY_SZ];
+    uint8_t appSKey[SKEY_SZ];
+    uint32_t fcntUp;        // checkpoint : no uplink used a counter >= fcntUp+FCNT_GAP
+    uint32_t fcntDown;
+} LORASESS_t;
+static LORASESS_t _sess;
+
+// Saving goes to the default event queue (main task) : the FCB writes need more stack than the lora task has
+static uint8_t _savePending;        // SAVE_xxx
+static void lorasess_save_ev(struct os_event* ev);
+static struct os_event _saveEv = {
+    .ev_cb = lorasess_save_ev,
+};
+
+static char* lorasess_conf_get(int argc, char** argv, char* val, int val_len_max);
+static int lorasess_conf_set(int argc, char** argv, char* val);
+
+static struct conf_handler _sessHandler = {
+    .ch_name = "lsess",
+    .ch_get = lorasess_conf_get,
+    .ch_set = lorasess_conf_set,
+    .ch_commit = NULL,
+    .ch_export = NULL,
+};
+
+static void put32(uint8_t* b, uint32_t v) {
+    for(int i=0;i<4;i++) {
+        b[i] = (v>>(8*i)) & 0xff;
+    }
+}
+static uint32_t get32(const uint8_t* b) {
+    return b[0] | (b[1]<<8) | (b[2]<<16) | ((uint32_t)b[3]<<24);
+}
+
+static char* lorasess_keys_str(const LORASESS_t* sess, char* str) {
+    uint8_t b[SESS_SZ];
+    put32(&b[0], sess->netId);
+    put32(&b[4], sess->devAddr);
+    memcpy(&b[8], sess->nwkSKey, SKEY_SZ);
+    memcpy(&b[8+SKEY_SZ], sess->appSKey, SKEY_SZ);
+    for(int i=0;i<SESS_SZ;i++) {
+        sprintf(&str[2*i], "%02x", b[i]);
+    }
+    return str;
+}
+
+static bool lorasess_keys_parse(const char* str) {
+    uint8_t b[SESS_SZ];
+    char hex[3] = { 0, 0, 0 };
+    char* end;
+    if (strlen(str)!=(SESS_STR_SZ-1)) {
+        return false;
+    }
+    for(int i=0;i<SESS_SZ;i++) {
+        hex[0] = str[2*i];
+        hex[1] = str[2*i+1];
+        b[i] = strtoul(hex, &end, 16);
+        if (*end!='\0') {
+            return false;
+        }
+    }
+    _sess.netId = get32(&b[0]);
+    _sess.devAddr = get32(&b[4]);
+    memcpy(_sess.nwkSKey, &b[8], SKEY_SZ);
+    memcpy(_sess.appSKey, &b[8+SKEY_SZ], SKEY_SZ);
+    return true;
+}
+
+static char* lorasess_conf_get(int argc, char** argv, char* val, int val_len_max) {
+    if (argc!=1) {
+        return NULL;
+    }
+    if (strcmp(argv[0], "keys")==0 && _sess.valid && val_len_max>=SESS_STR_SZ) {
+        return lorasess_keys_str(&_sess, val);
+    }
+    if (strcmp(argv[0], "fcnt")==0) {
+        snprintf(val, val_len_max, "%lu,%lu", (unsigned long)_sess.fcntUp, (unsigned long)_sess.fcntDown);
+        return val;
+    }
+    return NULL;
+}
+
+// Loading the saved session
+static int lorasess_conf_set(int argc, char** argv, char* val) {
+    if (argc!=1) {
+        return OS_ENOENT;
+    }
+    if (strcmp(argv[0], "keys")==0) {
+        // a forgotten session is saved as no value
+        _sess.valid = (val!=NULL && lorasess_keys_parse(val));
+        return 0;
+    }
+    if (strcmp(argv[0], "fcnt")==0) {
+        unsigned long up, down;
+        if (val==NULL || sscanf(val, "%lu,%lu", &up, &down)!=2) {
+            return OS_EINVAL;
+        }
+        _sess.fcntUp = up;
+        _sess.fcntDown = down;
+        return 0;
+    }
+    return OS_ENOENT;
+}
+
+static void lorasess_save_one(const char* name, char* val) {
+    if (conf_save_one(name, val)!=0) {
+        console_printf("lorasess : failed to save %s\r\n", name);
+    }
+}
+
+static void lorasess_save_ev(struct os_event* ev) {
+    LORASESS_t sess;
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    uint8_t what = _savePending;
+    _savePending = 0;
+    sess = _sess;
+    OS_EXIT_CRITICAL(sr);
+    if (what & SAVE_KEYS) {
+        // a forgotten session is saved as no value
+        char str[SESS_STR_SZ];
+        lorasess_save_one("lsess/keys", sess.valid?lorasess_keys_str(&sess, str):NULL);
+    }
+    if (what & SAVE_FCNT) {
+        char str[FCNT_STR_SZ];
+        snprintf(str, sizeof(str), "%lu,%lu", (unsigned long)sess.fcntUp, (unsigned long)sess.fcntDown);
+        lorasess_save_one("lsess/fcnt", str);
+    }
+}
+
+// Have the current values saved soon
+static void lorasess_save(uint8_t what) {
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    _savePending |= what;
+    OS_EXIT_CRITICAL(sr);
+    os_eventq_put(os_eventq_dflt_get(), &_saveEv);
+}
+
+static uint32_t lorasess_counter(Mib_t type) {
+    MibRequestConfirm_t mib;
+    mib.Type = type;
+    if (LoRaMacMibGetRequestConfirm(&mib)!=LORAMAC_STATUS_OK) {
+        return 0;
+    }
+    return (type==MIB_UPLINK_COUNTER)?mib.Param.UpLinkCounter:mib.Param.DownLinkCounter;
+}
+
+void lorasess_init(void) {
+    memset(&_sess, 0, sizeof(_sess));
+    int rc = conf_register(&_sessHandler);
+    assert(rc==0);
+}
+
+bool lorasess_restore(void) {
+    MibRequestConfirm_t mib;
+    bool ok = _sess.valid;
+    if (!ok) {
+        return false;
+    }
+    mib.Type = MIB_NET_ID;
+    mib.Param.NetID = _sess.netId;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    mib.Type = MIB_DEV_ADDR;
+    mib.Param.DevAddr = _sess.devAddr;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    mib.Type = MIB_NWK_SKEY;
+    mib.Param.NwkSKey = _sess.nwkSKey;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    mib.Type = MIB_APP_SKEY;
+    mib.Param.AppSKey = _sess.appSKey;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    // skip the counters that may have been used since the checkpoint, and checkpoint again before using any
+    _sess.fcntUp += FCNT_GAP;
+    mib.Type = MIB_UPLINK_COUNTER;
+    mib.Param.UpLinkCounter = _sess.fcntUp;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    mib.Type = MIB_DOWNLINK_COUNTER;
+    mib.Param.DownLinkCounter = _sess.fcntDown;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    mib.Type = MIB_NETWORK_JOINED;
+    mib.Param.IsNetworkJoined = true;
+    ok = ok && (LoRaMacMibSetRequestConfirm(&mib)==LORAMAC_STATUS_OK);
+    if (!ok) {
+        console_printf("lorasess : stack refused the saved session, joining\r\n");
+        _sess.valid = false;
+        return false;
+    }
+    lorasess_save(SAVE_FCNT);
+    console_printf("lorasess : resumed session %08lx at fcnt %lu\r\n", (unsigned long)_sess.devAddr, (unsigned long)_sess.fcntUp);
+    return true;
+}
+
+void lorasess_check(void) {
+    MibRequestConfirm_t mib;
+    mib.Type = MIB_NETWORK_JOINED;
+    if (LoRaMacMibGetRequestConfirm(&mib)!=LORAMAC_STATUS_OK || !mib.Param.IsNetworkJoined) {
+        // not yet : the join goes with the next uplink
+        return;
+    }
+    uint32_t up = lorasess_counter(MIB_UPLINK_COUNTER);
+    mib.Type = MIB_DEV_ADDR;
+    LoRaMacMibGetRequestConfirm(&mib);
+    uint32_t devAddr = mib.Param.DevAddr;
+    mib.Type = MIB_NWK_SKEY;
+    LoRaMacMibGetRequestConfirm(&mib);
+    if (!_sess.valid || devAddr!=_sess.devAddr || memcmp(mib.Param.NwkSKey, _sess.nwkSKey, SKEY_SZ)!=0) {
+        // (re)joined : a new session
+        memcpy(_sess.nwkSKey, mib.Param.NwkSKey, SKEY_SZ);
+        _sess.devAddr = devAddr;
+        mib.Type = MIB_APP_SKEY;
+        LoRaMacMibGetRequestConfirm(&mib);
+        memcpy(_sess.appSKey, mib.Param.AppSKey, SKEY_SZ);
+        mib.Type = MIB_NET_ID;
+        LoRaMacMibGetRequestConfirm(&mib);
+        _sess.netId = mib.Param.NetID;
+        _sess.valid = true;
+        lorasess_save(SAVE_KEYS);
+    } else if (up<(_sess.fcntUp+FCNT_GAP-FCNT_SAVE_AHEAD)) {
+        // still covered by the last checkpoint
+        return;
+    }
+    _sess.fcntUp = up;
+    _sess.fcntDown = lorasess_counter(MIB_DOWNLINK_COUNTER);
+    lorasess_save(SAVE_FCNT);
+}
+
+void lorasess_forget(void) {
+    if (_sess.valid) {
+        _sess.valid = false;
+        lorasess_save(SAVE_KEYS);
+        console_printf("lorasess : session forgotten, will join at next reboot\r\n");
+    }
+}
@@ -43,6 +43,10 @@
 #include "wutils.h"
 #include "main.h"
 #include "LoRa_message.h"
+#include "appcfg.h"
+#include "lorasess.h"
+#include "journal.h"
+#include "dlcmd.h"
 
 
 //#define DEBUG 1
@@ -53,21 +57,32 @@ static int button_tries_error=0;
 static int current_data=2;
 
 /*Declaration of calback function of LoRa wait event result*/
-static void tx_cb_fun (LORA_TX_RESULT_t e)
+static void tx_cb_fun (const LORA_TX_RES_t* res)
 {
-    console_printf("tx result %d \r\n",e);
-    
-    if (e != LORA_TX_OK) {
-        console_printf("tx error \r\n");
-        sendEvent(LORA_TX_STATUS, (void*)(e));
+    console_printf("tx result %d for frame %d (fcnt %lu, toa %d ms at %d dBm, %d mA)\r\n", res->result, res->frameId, 
+        (unsigned long)res->fcnt, res->toaMs, res->txPowerDbm, res->txmA);
+    if (res->acked) 
+    {
+        console_printf("ack rssi %d dBm, snr %d dB\r\n", res->rssi, res->snr);
+    }
+    if (journal_tx_result(res)) 
+    {
+        // a backlog frame, the state machine is not waiting for it
+        return;
     }
-    sendEvent(LORA_TX_STATUS, (void*)(LORA_TX_OK_ACKD));  
+    sendEvent(LORA_TX_STATUS, SM_TX_STATUS(res->frameId, res->result));
 }
 
 static void rx_cb_fun (uint8_t port, void* data, uint8_t sz)
 {
-    console_printf("rx received \r\n");
-    //sendEvent(LORA_TX_STATUS, (void*)(LORA_TX_OK_ACKD));
+    console_printf("rx received on port %d, %d bytes\r\n", port, sz);
+    uint32_t changed = dlcmd_process(data, sz);
+    lora_app_rx_free(data);
+    if (changed!=0) 
+    {
+        // for the state machine to apply the ones it has in use
+        sendEvent(LORA_RX, (void*)(uintptr_t)changed);
+    }
 }
 
 
@@ -137,6 +152,12 @@ main(int argc, char **argv)
 
     console_printf(":==================Console connected !===========================:\r\n");   
     
+    // saved parameters, before anyone uses them (the session handler must be there when they are loaded)
+    lorasess_init();
+    appcfg_init();
+    // door events not acked before the reboot are still there
+    journal_init();
+
     lora_app_init(&tx_cb_fun, &rx_cb_fun);
 
     start_statemachine();
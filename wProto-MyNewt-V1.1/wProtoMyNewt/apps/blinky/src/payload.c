@@ -0,0 +1,189 @@
+/**
+ Wyres private code
+ Uplink payload encoder, driven by the schema table generated from PAYLOAD_SCHEMA.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "payload.h"
+
+typedef struct {
+    uint8_t bits;
+    bool optional;
+    int32_t min;
+    int32_t max;
+} PL_FIELD_DESC_t;
+
+#define PL_FIELD(n, b, mn, mx, opt) [PL_##n] = { .bits = (b), .min = (mn), .max = (mx), .optional = (opt) },
+static const PL_FIELD_DESC_t _plSchema[PL_NB_FIELDS] = {
+    PAYLOAD_SCHEMA
+};
+#undef PL_FIELD
+
+// Bit writer : MSB first
+typedef struct {
+    uint8_t* buf;
+    uint16_t bitpos;
+} PL_BITWR_t;
+
+static void pl_put(PL_BITWR_t* w, uint32_t v, uint8_t bits) {
+    while (bits>0) {
+        uint8_t room = 8-(w->bitpos & 7);
+        uint8_t n = (bits<room)?bits:room;
+        uint8_t chunk = (v >> (bits-n)) & ((1<<n)-1);
+        w->buf[w->bitpos>>3] |= (chunk << (room-n));
+        w->bitpos += n;
+        bits -= n;
+    }
+}
+
+static uint32_t pl_quantize(const PL_FIELD_DESC_t* fd, int32_t v) {
+    uint32_t steps = (1u<<fd->bits)-1;
+    if (v<=fd->min) {
+        return 0;
+    }
+    if (v>=fd->max) {
+        return steps;
+    }
+    uint32_t range = (uint32_t)(fd->max-fd->min);
+    return (((uint32_t)(v-fd->min)*steps)+(range/2))/range;
+}
+
+void payload_init(PAYLOAD_t* p) {
+    memset(p, 0, sizeof(PAYLOAD_t));
+    payload_set(p, PL_VERSION, PAYLOAD_VERSION);
+}
+
+void payload_set(PAYLOAD_t* p, PL_FIELD_ID f, int32_t v) {
+    assert(f<PL_NB_FIELDS);
+    p->values[f] = v;
+    p->present |= (1u<<f);
+}
+
+// Field whose coding is used for each record kind
+static const PL_FIELD_ID _plRecFields[] = {
+    [PL_REC_DOOR] = PL_DOOR,
+    [PL_REC_BATTERY] = PL_BATTERY,
+};
+
+bool payload_add_record(PAYLOAD_t* p, uint8_t kind, uint16_t ageSecs, int32_t value) {
+    assert(kind<(sizeof(_plRecFields)/sizeof(_plRecFields[0])));
+    if (p->nrecs>=PL_MAX_RECORDS) {
+        return false;
+    }
+    p->recs[p->nrecs].kind = kind;
+    p->recs[p->nrecs].ageSecs = ageSecs;
+    p->recs[p->nrecs].value = value;
+    p->nrecs++;
+    return true;
+}
+
+bool payload_add_history(PAYLOAD_t* p, uint16_t seq, uint8_t door, uint32_t ageSecs) {
+    if (p->nhist>=PL_MAX_HISTORY) {
+        return false;
+    }
+    p->hist[p->nhist].door = door;
+    p->hist[p->nhist].ageSecs = ageSecs;
+    p->histSeq = seq;
+    p->nhist++;
+    return true;
+}
+
+// Time of history event i before the frame (the newest) or before the event after it
+static uint32_t pl_hist_delta(const PAYLOAD_t* p, int i) {
+    uint32_t next = (i==(p->nhist-1))?0:p->hist[i+1].ageSecs;
+    return (p->hist[i].ageSecs>next)?(p->hist[i].ageSecs-next):0;
+}
+static bool pl_hist_secs(uint32_t delta) {
+    return (delta<(1u<<PL_HIST_SECS_BITS));
+}
+
+// Encoded size in bits (a missing required field is counted as if present)
+static uint16_t pl_bits(const PAYLOAD_t* p) {
+    uint16_t bits = 0;
+    for(int f=0;f<PL_NB_FIELDS;f++) {
+        bool present = ((p->present & (1u<<f))!=0);
+        if (_plSchema[f].optional) {
+            bits += 1 + (present?_plSchema[f].bits:0);
+        } else {
+            bits += _plSchema[f].bits;
+        }
+    }
+    bits += 1;
+    if (p->nrecs>0) {
+        bits += PL_REC_COUNT_BITS;
+        for(int i=0;i<p->nrecs;i++) {
+            bits += 1 + PL_REC_AGE_BITS + _plSchema[_plRecFields[p->recs[i].kind]].bits;
+        }
+    }
+    bits += 1;
+    if (p->nhist>0) {
+        bits += PL_HIST_COUNT_BITS + PL_HIST_SEQ_BITS;
+        for(int i=0;i<p->nhist;i++) {
+            bits += 2 + (pl_hist_secs(pl_hist_delta(p, i))?PL_HIST_SECS_BITS:PL_HIST_MINS_BITS);
+        }
+    }
+    return bits;
+}
+
+uint8_t payload_size(const PAYLOAD_t* p) {
+    return (pl_bits(p)+7)/8;
+}
+
+uint8_t payload_encode(const PAYLOAD_t* p, uint8_t* buf, uint8_t sz) {
+    for(int f=0;f<PL_NB_FIELDS;f++) {
+        if (!_plSchema[f].optional && (p->present & (1u<<f))==0) {
+            return 0;
+        }
+    }
+    uint8_t len = payload_size(p);
+    if (len>sz) {
+        return 0;
+    }
+    memset(buf, 0, len);
+    PL_BITWR_t w = { .buf = buf, .bitpos = 0 };
+    for(int f=0;f<PL_NB_FIELDS;f++) {
+        bool present = ((p->present & (1u<<f))!=0);
+        if (_plSchema[f].optional) {
+            pl_put(&w, present?1:0, 1);
+        }
+        if (present) {
+            pl_put(&w, pl_quantize(&_plSchema[f], p->values[f]), _plSchema[f].bits);
+        }
+    }
+    pl_put(&w, (p->nrecs>0)?1:0, 1);
+    if (p->nrecs>0) {
+        pl_put(&w, p->nrecs, PL_REC_COUNT_BITS);
+        for(int i=0;i<p->nrecs;i++) {
+            const PL_FIELD_DESC_t* fd = &_plSchema[_plRecFields[p->recs[i].kind]];
+            uint16_t age = p->recs[i].ageSecs;
+            pl_put(&w, p->recs[i].kind, 1);
+            pl_put(&w, (age<(1<<PL_REC_AGE_BITS))?age:((1<<PL_REC_AGE_BITS)-1), PL_REC_AGE_BITS);
+            pl_put(&w, pl_quantize(fd, p->recs[i].value), fd->bits);
+        }
+    }
+    pl_put(&w, (p->nhist>0)?1:0, 1);
+    if (p->nhist>0) {
+        pl_put(&w, p->nhist, PL_HIST_COUNT_BITS);
+        pl_put(&w, p->histSeq, PL_HIST_SEQ_BITS);
+        for(int i=p->nhist-1;i>=0;i--) {
+            uint32_t delta = pl_hist_delta(p, i);
+            pl_put(&w, p->hist[i].door, 1);
+            if (pl_hist_secs(delta)) {
+                pl_put(&w, 0, 1);
+                pl_put(&w, delta, PL_HIST_SECS_BITS);
+            } else {
+                uint32_t mins = delta/60;
+                pl_put(&w, 1, 1);
+                pl_put(&w, (mins<(1u<<PL_HIST_MINS_BITS))?mins:((1u<<PL_HIST_MINS_BITS)-1), PL_HIST_MINS_BITS);
+            }
+        }
+    }
+    return len;
+}
+
+uint32_t payload_quantize(PL_FIELD_ID f, int32_t v) {
+    assert(f<PL_NB_FIELDS);
+    return pl_quantize(&_plSchema[f], v);
+}
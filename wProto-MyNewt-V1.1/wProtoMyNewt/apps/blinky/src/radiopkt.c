@@ -0,0 +1,20 @@
+/**
+ Wyres private code
+ Signal quality of the last packet received, from the radio driver.
+ */
+
+/*
+ * Assumes the SX1272 driver of the loramac_node_stackforce tree under lorawan_wrapper (LoRaMac-node 4.x layout) :
+ * its RxDone IRQ handler leaves the RSSI (dBm) and SNR (dB) of the packet in SX1272.Settings.LoRaPacketHandler
+ * before the MAC gets it, and nothing changes them until the next rx. Its header is found through the radio
+ * include path in pkg.yml, there for this file only. If the wrapper ever passes on the MCPS indication (it has
+ * both), take them from there and drop this.
+ */
+#include "sx1272/sx1272.h"
+
+#include "radiopkt.h"
+
+void radiopkt_last(int16_t* rssi, int8_t* snr) {
+    *rssi = SX1272.Settings.LoRaPacketHandler.RssiValue;
+    *snr = SX1272.Settings.LoRaPacketHandler.SnrValue;
+}
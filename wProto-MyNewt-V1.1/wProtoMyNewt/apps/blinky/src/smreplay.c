@@ -0,0 +1,280 @@
+/**
+ Wyres private code
+ Capture of the state machine input stream, and its replay on the sim target under virtual time.
+ Stream format (one record per line, as dumped at boot or by 'smcap') : C <tick> <kind> <event> <value>
+ <event> is the event for SMIN_EVENT records, the id given to SM_INPUT_ID() for the others.
+ A stream that does not start at boot starts with the snapshot it is replayed from : S <seq> <state bytes in hex>
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "os/os.h"
+#include "bsp/bsp.h"
+#include "console/console.h"
+#include "crc/crc16.h"
+#if MYNEWT_VAL(SHELL_TASK)
+#include "shell/shell.h"
+#endif
+
+#include "wutils.h"
+#include "statemach.h"
+#include "smstats.h"
+#include "smreplay.h"
+
+#if MYNEWT_VAL(SM_CAPTURE) || MYNEWT_VAL(SM_REPLAY)
+
+#if MYNEWT_VAL(SM_REPLAY) && !defined(ARCH_sim)
+#error "SM_REPLAY is only for the sim target"
+#endif
+
+#define SMCAP_SZ            MYNEWT_VAL(SM_CAPTURE_SIZE)
+#define SMCAP_STATE_SZ      MYNEWT_VAL(SM_CAPTURE_STATE_SIZE)
+#define SMCAP_MAX_STATES    (16)
+#define SMCAP_NO_SNAP       (0xFFFFFFFF)
+
+typedef struct {
+    uint32_t tick;
+    uint8_t kind;
+    uint8_t e;
+    uint32_t value;
+} SM_INPUT_REC_t;
+
+// The registered state, copied in registration order
+typedef struct {
+    uint32_t seq;               // number of the record it is the state before, SMCAP_NO_SNAP if none
+    uint16_t len;
+    uint8_t data[SMCAP_STATE_SZ];
+} SM_CAP_SNAP_t;
+
+static struct {
+    void* p;
+    uint16_t sz;
+} _states[SMCAP_MAX_STATES];
+static uint8_t _nstates=0;
+static uint16_t _stateLen=0;
+
+void smcapture_state(void* p, uint16_t sz) {
+    assert(_nstates<SMCAP_MAX_STATES && (_stateLen+sz)<=SMCAP_STATE_SZ);
+    _states[_nstates].p = p;
+    _states[_nstates].sz = sz;
+    _nstates++;
+    _stateLen += sz;
+}
+#endif
+
+#if MYNEWT_VAL(SM_CAPTURE)
+#define SMCAP_MAGIC         (0x534d4302)        // 'SMC' + layout version
+
+// Not zeroed at boot : dumped at the next boot if sealed before a controlled reboot.
+// The ring holds the last SMCAP_SZ records. A snapshot is taken every SMCAP_SZ/2 records or so, and the two newest
+// are kept, so the oldest one still in the ring lets the last SMCAP_SZ/2 to SMCAP_SZ records be replayed.
+typedef struct {
+    uint32_t magic;
+    uint16_t crc;               // over the rest, valid only once sealed
+    uint8_t snapNext;           // the older snapshot, overwritten by the next one
+    uint32_t seq;               // records since boot
+    SM_CAP_SNAP_t snaps[2];
+    SM_INPUT_REC_t recs[SMCAP_SZ];
+} SM_CAPTURE_t;
+static bssnz_t SM_CAPTURE_t _cap;
+
+static uint16_t smcapture_crc(void) {
+    return crc16_ccitt(CRC16_INITIAL_CRC, &_cap.snapNext, sizeof(_cap)-offsetof(SM_CAPTURE_t, snapNext));
+}
+
+static void smcapture_add(SMIN_KIND k, uint8_t e, uint32_t v) {
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    SM_INPUT_REC_t* r = &_cap.recs[_cap.seq%SMCAP_SZ];
+    _cap.seq++;
+    OS_EXIT_CRITICAL(sr);
+    r->tick = os_time_get();
+    r->kind = k;
+    r->e = e;
+    r->value = v;
+}
+
+void smcapture_event(uint8_t e, uint32_t data) {
+    smcapture_add(SMIN_EVENT, e, data);
+}
+
+uint32_t smcapture_input(SMIN_KIND k, uint8_t id, uint32_t v) {
+    smcapture_add(k, id, v);
+    return v;
+}
+
+void smcapture_snapshot(void) {
+    uint32_t newest = _cap.snaps[_cap.snapNext^1].seq;
+    if (_cap.seq-((newest==SMCAP_NO_SNAP)?0:newest)<SMCAP_SZ/2) {
+        return;
+    }
+    SM_CAP_SNAP_t* s = &_cap.snaps[_cap.snapNext];
+    uint16_t off = 0;
+    for(int i=0;i<_nstates;i++) {
+        memcpy(&s->data[off], _states[i].p, _states[i].sz);
+        off += _states[i].sz;
+    }
+    s->len = off;
+    s->seq = _cap.seq;
+    _cap.snapNext ^= 1;
+}
+
+void smcapture_seal(void) {
+    _cap.crc = smcapture_crc();
+}
+
+// Dump the replayable part of the ring : from boot if it is all there, else from the oldest snapshot in it
+static void smcapture_dump(void) {
+    uint32_t first = (_cap.seq>SMCAP_SZ)?(_cap.seq-SMCAP_SZ):0;
+    if (first>0) {
+        const SM_CAP_SNAP_t* s = NULL;
+        for(int i=0;i<2;i++) {
+            if (_cap.snaps[i].seq!=SMCAP_NO_SNAP && _cap.snaps[i].seq>=first && (s==NULL || _cap.snaps[i].seq<s->seq)) {
+                s = &_cap.snaps[i];
+            }
+        }
+        if (s!=NULL) {
+            first = s->seq;
+            console_printf("S %lu ", (unsigned long)s->seq);
+            for(int i=0;i<s->len;i++) {
+                console_printf("%02x", s->data[i]);
+            }
+            console_printf("\r\n");
+        } else {
+            console_printf("# no snapshot in the ring : not replayable\r\n");
+        }
+    }
+    for(uint32_t q=first;q<_cap.seq;q++) {
+        SM_INPUT_REC_t* r = &_cap.recs[q%SMCAP_SZ];
+        console_printf("C %lu %d %d %lu\r\n", (unsigned long)r->tick, r->kind, r->e, (unsigned long)r->value);
+    }
+    console_printf("# records %lu to %lu\r\n", (unsigned long)first, (unsigned long)_cap.seq);
+}
+
+#if MYNEWT_VAL(SHELL_TASK)
+static int smcap_cmd(int argc, char** argv) {
+    smcapture_dump();
+    return 0;
+}
+static struct shell_cmd _smcapCmd = {
+    .sc_cmd = "smcap",
+    .sc_cmd_func = smcap_cmd,
+};
+#endif
+
+void smcapture_init(void) {
+    if (_cap.magic==SMCAP_MAGIC && _cap.crc==smcapture_crc()) {
+        console_printf("# sm capture of the previous run\r\n");
+        smcapture_dump();
+    }
+    memset(&_cap, 0, sizeof(_cap));
+    _cap.magic = SMCAP_MAGIC;
+    _cap.snaps[0].seq = SMCAP_NO_SNAP;
+    _cap.snaps[1].seq = SMCAP_NO_SNAP;
+    // not sealed
+    _cap.crc = smcapture_crc()+1;
+#if MYNEWT_VAL(SHELL_TASK)
+    shell_cmd_register(&_smcapCmd);
+#endif
+}
+#else
+void smcapture_init(void) {
+}
+#endif /* SM_CAPTURE */
+
+#if MYNEWT_VAL(SM_REPLAY)
+// The loaded stream, and the snapshot it starts from if any
+static SM_INPUT_REC_t _recs[SMCAP_SZ];
+static uint16_t _nrecs=0;
+static SM_CAP_SNAP_t _snap = { .seq = SMCAP_NO_SNAP };
+static uint16_t _cur=0;
+static os_time_t _vtime=0;
+
+void smreplay_init(void) {
+    FILE* f = fopen(MYNEWT_VAL(SM_REPLAY_FILE), "r");
+    if (f==NULL) {
+        console_printf("replay : cannot open %s\r\n", MYNEWT_VAL(SM_REPLAY_FILE));
+        exit(1);
+    }
+    char line[2*SMCAP_STATE_SZ+32];
+    unsigned long tick, value;
+    unsigned int kind, e;
+    int n;
+    while (_nrecs<SMCAP_SZ && fgets(line, sizeof(line), f)!=NULL) {
+        if (sscanf(line, "C %lu %u %u %lu", &tick, &kind, &e, &value)==4) {
+            _recs[_nrecs].tick = tick;
+            _recs[_nrecs].kind = kind;
+            _recs[_nrecs].e = e;
+            _recs[_nrecs].value = value;
+            _nrecs++;
+        } else if (_nrecs==0 && sscanf(line, "S %lu %n", &value, &n)==1) {
+            _snap.seq = value;
+            _snap.len = 0;
+            for(char* h=line+n;_snap.len<SMCAP_STATE_SZ && sscanf(h, "%2x", &e)==1;h+=2) {
+                _snap.data[_snap.len++] = e;
+            }
+        }
+    }
+    fclose(f);
+    console_printf("replay : %d records loaded%s\r\n", _nrecs, (_snap.seq!=SMCAP_NO_SNAP)?" after a snapshot":"");
+    if (_nrecs>0) {
+        _vtime = _recs[0].tick;
+    }
+}
+
+bool smreplay_snapshot(void) {
+    if (_snap.seq==SMCAP_NO_SNAP) {
+        return false;
+    }
+    if (_snap.len!=_stateLen) {
+        console_printf("replay : snapshot of %d bytes, %d registered\r\n", _snap.len, _stateLen);
+        smreplay_finish("diverged");
+    }
+    uint16_t off = 0;
+    for(int i=0;i<_nstates;i++) {
+        memcpy(_states[i].p, &_snap.data[off], _states[i].sz);
+        off += _states[i].sz;
+    }
+    console_printf("replay : from the snapshot before record %lu, in state %d\r\n", (unsigned long)_snap.seq, sm_get_state());
+    return true;
+}
+
+void smreplay_finish(const char* why) {
+    console_printf("replay : %s after %d/%d records, t=%lu ms, final state %d\r\n",
+        why, _cur, _nrecs, (unsigned long)os_time_ticks_to_ms32(_vtime), sm_get_state());
+    smstats_dump();
+    exit((_cur==_nrecs)?0:2);
+}
+
+uint32_t smreplay_input(SMIN_KIND k, uint8_t id) {
+    if (_cur>=_nrecs) {
+        smreplay_finish("stream ended while reading an input");
+    }
+    if (_recs[_cur].kind!=k || _recs[_cur].e!=id) {
+        console_printf("replay : diverged at record %d, wanted input %d/%d got %d/%d\r\n", _cur, k, id, _recs[_cur].kind, _recs[_cur].e);
+        smreplay_finish("diverged");
+    }
+    _vtime = _recs[_cur].tick;
+    return _recs[_cur++].value;
+}
+
+os_time_t smreplay_time(void) {
+    return _vtime;
+}
+
+void smreplay_run(void) {
+    while (_cur<_nrecs) {
+        if (_recs[_cur].kind!=SMIN_EVENT) {
+            console_printf("replay : diverged at record %d, input %d not consumed\r\n", _cur, _recs[_cur].kind);
+            smreplay_finish("diverged");
+        }
+        SM_INPUT_REC_t* r = &_recs[_cur++];
+        _vtime = r->tick;
+        sm_inject(r->e, (void*)(uintptr_t)r->value);
+    }
+    smreplay_finish("done");
+}
+#endif /* SM_REPLAY */
@@ -0,0 +1,185 @@
+/**
+ Wyres private code
+ State machine statistics : residency / entries / transition cost per state, kept across soft reboots
+ */
+
+#include <string.h>
+
+#include "os/os.h"
+#include "bsp/bsp.h"
+#include "console/console.h"
+#if MYNEWT_VAL(SHELL_TASK)
+#include "shell/shell.h"
+#endif
+
+#include "wutils.h"
+#include "LoRa_message.h"
+#include "smstats.h"
+#include "smreplay.h"
+#include "smtrace.h"
+
+#define SMSTATS_MAGIC       (0x534d5301)        // 'SMS' + version of the layout
+#define SMSTATS_FRAME_VER   (1)
+#define SMSTATS_DIAG_RETRY_MS   (60000)         // not joined or radio busy : try again in a minute
+
+// Not zeroed at boot : validated by the magic in smstats_init()
+static bssnz_t SM_STATS_t _smStats;
+static os_time_t _enteredAt;
+static struct os_callout _diagTimer;
+
+static void smstats_diag_cb(struct os_event* ev);
+
+#if MYNEWT_VAL(SHELL_TASK)
+static int smstats_cmd(int argc, char** argv);
+static struct shell_cmd _smstatsCmd = {
+    .sc_cmd = "smstats",
+    .sc_cmd_func = smstats_cmd,
+};
+#endif
+
+void smstats_init(void) {
+    if (_smStats.magic!=SMSTATS_MAGIC) {
+        smstats_reset();
+    } else {
+        _smStats.boots++;
+        console_printf("state machine stats kept over reboot (%d boots)\r\n", _smStats.boots);
+        smstats_dump();
+    }
+    _enteredAt = sm_time_get();
+    // the diag uplink goes from the default event queue, with or without the shell
+    os_callout_init(&_diagTimer, os_eventq_dflt_get(), smstats_diag_cb, NULL);
+#if MYNEWT_VAL(SM_STATS_DIAG_PERIOD_H)>0
+    os_callout_reset(&_diagTimer, MYNEWT_VAL(SM_STATS_DIAG_PERIOD_H)*3600*OS_TICKS_PER_SEC);
+#endif
+#if MYNEWT_VAL(SHELL_TASK)
+    shell_cmd_register(&_smstatsCmd);
+#endif
+}
+
+void smstats_reset(void) {
+    memset(&_smStats, 0, sizeof(_smStats));
+    _smStats.magic = SMSTATS_MAGIC;
+}
+
+const SM_STATS_t* smstats_get(void) {
+    return &_smStats;
+}
+
+void smstats_transition(STATE from, STATE to, uint32_t handlerUs) {
+    os_time_t now = sm_time_get();
+    if (from<SM_NB_STATES) {
+        SM_STATE_STATS_t* fs = &_smStats.states[from];
+        uint32_t ms = os_time_ticks_to_ms32(now-_enteredAt) + fs->residencyMs;
+        fs->residencyS += ms/1000;
+        fs->residencyMs = ms%1000;
+    }
+    _enteredAt = now;
+    if (to<SM_NB_STATES) {
+        SM_STATE_STATS_t* ts = &_smStats.states[to];
+        if (ts->entries<UINT16_MAX) {
+            ts->entries++;
+        }
+        ts->handlerUs += handlerUs;
+        if (handlerUs>ts->handlerMaxUs) {
+            ts->handlerMaxUs = (handlerUs>UINT16_MAX)?UINT16_MAX:handlerUs;
+        }
+    }
+}
+
+void smstats_chain(uint8_t chain, uint16_t stackUsed) {
+    if (chain>_smStats.maxChain) {
+        _smStats.maxChain = chain;
+        console_printf("deepest transition chain now %d, stack used %d words\r\n", chain, stackUsed);
+    }
+    if (stackUsed>_smStats.stackUsedMax) {
+        _smStats.stackUsedMax = stackUsed;
+    }
+}
+
+void smstats_chain_abort(void) {
+    if (_smStats.chainAborts<UINT8_MAX) {
+        _smStats.chainAborts++;
+    }
+}
+
+void smstats_evq_overflow(uint16_t nb) {
+    _smStats.evqOverflows = ((uint32_t)_smStats.evqOverflows+nb>UINT16_MAX)?UINT16_MAX:_smStats.evqOverflows+nb;
+}
+
+void smstats_dump(void) {
+    console_printf("sm stats : boots %d, max chain %d (aborts %d), stack %d words, evq overflows %d\r\n",
+        _smStats.boots, _smStats.maxChain, _smStats.chainAborts, _smStats.stackUsedMax, _smStats.evqOverflows);
+    for(int i=0;i<SM_NB_STATES;i++) {
+        SM_STATE_STATS_t* s = &_smStats.states[i];
+        if (s->entries>0) {
+            console_printf(" state %2d : %5d entries, %8lu.%03d s, handlers %lu us (max %d)\r\n", 
+                i, s->entries, (unsigned long)s->residencyS, s->residencyMs, (unsigned long)s->handlerUs, s->handlerMaxUs);
+        }
+    }
+}
+
+/*
+ * Diagnostic frame : [ver][boots][maxChain][chainAborts][stackUsedMax/4]
+ * then for each entered state while it fits : [state][entries BE16][residency minutes BE16]
+ */
+uint8_t smstats_build_frame(uint8_t* buf, uint8_t sz) {
+    assert(sz>=5);
+    uint8_t len = 0;
+    buf[len++] = SMSTATS_FRAME_VER;
+    buf[len++] = (_smStats.boots>UINT8_MAX)?UINT8_MAX:_smStats.boots;
+    buf[len++] = _smStats.maxChain;
+    buf[len++] = _smStats.chainAborts;
+    buf[len++] = (_smStats.stackUsedMax/4>UINT8_MAX)?UINT8_MAX:_smStats.stackUsedMax/4;
+    for(int i=0;i<SM_NB_STATES && (len+5)<=sz;i++) {
+        SM_STATE_STATS_t* s = &_smStats.states[i];
+        if (s->entries>0) {
+            uint32_t mins = s->residencyS/60;
+            if (mins>UINT16_MAX) {
+                mins = UINT16_MAX;
+            }
+            buf[len++] = i;
+            buf[len++] = (s->entries>>8) & 0xff;
+            buf[len++] = s->entries & 0xff;
+            buf[len++] = (mins>>8) & 0xff;
+            buf[len++] = mins & 0xff;
+        }
+    }
+    return len;
+}
+
+LORA_TX_RESULT_t smstats_send_diag(void) {
+    uint8_t frame[LORA_DIAG_MAX_SZ];
+    uint8_t len = smstats_build_frame(frame, sizeof(frame));
+    LORA_TX_RESULT_t res = lora_app_tx_diag(frame, len);
+    console_printf("diag frame of %d bytes tx result %d\r\n", len, res);
+    return res;
+}
+
+void smstats_diag_request(void) {
+    os_callout_reset(&_diagTimer, 0);
+}
+
+static void smstats_diag_cb(struct os_event* ev) {
+    if (smstats_send_diag()==LORA_TX_ERR_RETRY) {
+        os_callout_reset(&_diagTimer, (SMSTATS_DIAG_RETRY_MS*OS_TICKS_PER_SEC)/1000);
+        return;
+    }
+#if MYNEWT_VAL(SM_STATS_DIAG_PERIOD_H)>0
+    os_callout_reset(&_diagTimer, MYNEWT_VAL(SM_STATS_DIAG_PERIOD_H)*3600*OS_TICKS_PER_SEC);
+#endif
+}
+
+#if MYNEWT_VAL(SHELL_TASK)
+static int smstats_cmd(int argc, char** argv) {
+    if (argc>1 && strcmp(argv[1], "reset")==0) {
+        smstats_reset();
+    } else if (argc>1 && strcmp(argv[1], "trace")==0) {
+        smtrace_dump();
+    } else if (argc>1 && strcmp(argv[1], "diag")==0) {
+        smstats_diag_request();
+    } else {
+        smstats_dump();
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,121 @@
+/**
+ Wyres private code
+ State machine timer service : several named timers on one callout.
+ */
+
+#include <assert.h>
+
+#include "os/os.h"
+#include "console/console.h"
+
+#include "smtimer.h"
+
+static struct {
+    os_time_t due[SMT_NB_TIMERS];
+    os_time_t period[SMT_NB_TIMERS];    // 0 for one shot
+    uint8_t running;                    // bit per timer
+    bool armed;
+    os_time_t armedFor;                 // deadline the callout is set for
+} _smt;
+
+static struct os_callout _smtCallout;
+static SMT_EXPIRED_FN_t _expiredFn = NULL;
+
+// Earliest running timer, or -1
+static int smtimer_next(void) {
+    int next = -1;
+    for(int i=0;i<SMT_NB_TIMERS;i++) {
+        if ((_smt.running & (1<<i)) && (next<0 || OS_TIME_TICK_LT(_smt.due[i], _smt.due[next]))) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+// Set the callout for the earliest deadline, only touching it when that changed
+static void smtimer_rearm(void) {
+    int next = smtimer_next();
+    if (next<0) {
+        if (_smt.armed) {
+            os_callout_stop(&_smtCallout);
+            _smt.armed = false;
+        }
+        return;
+    }
+    if (_smt.armed && _smt.armedFor==_smt.due[next]) {
+        return;
+    }
+    int32_t delta = (int32_t)(_smt.due[next]-os_time_get());
+    os_callout_reset(&_smtCallout, (delta>0)?delta:0);
+    _smt.armed = true;
+    _smt.armedFor = _smt.due[next];
+}
+
+static void smtimer_cb(struct os_event* ev) {
+    _smt.armed = false;
+    // One at a time : an expiry action may stop or restart the other timers
+    while(1) {
+        int id = smtimer_next();
+        os_time_t now = os_time_get();
+        if (id<0 || OS_TIME_TICK_GT(_smt.due[id], now)) {
+            break;
+        }
+        if (_smt.period[id]>0) {
+            _smt.due[id] += _smt.period[id];
+            if (OS_TIME_TICK_LEQ(_smt.due[id], now)) {
+                // we were held up for more than a period : drop the missed ones
+                _smt.due[id] = now + _smt.period[id];
+            }
+        } else {
+            _smt.running &= ~(1<<id);
+        }
+        if (_expiredFn!=NULL) {
+            (*_expiredFn)((SMT_ID)id);
+        }
+    }
+    smtimer_rearm();
+}
+
+void smtimer_init(struct os_eventq* q, SMT_EXPIRED_FN_t fn) {
+    _expiredFn = fn;
+    _smt.running = 0;
+    _smt.armed = false;
+    os_callout_init(&_smtCallout, q, smtimer_cb, NULL);
+}
+
+static void smtimer_set(SMT_ID id, uint32_t ms, os_time_t period) {
+    assert(id<SMT_NB_TIMERS);
+    _smt.due[id] = os_time_get() + os_time_ms_to_ticks32(ms);
+    _smt.period[id] = period;
+    _smt.running |= (1<<id);
+    smtimer_rearm();
+}
+
+void smtimer_start(SMT_ID id, uint32_t ms) {
+    smtimer_set(id, ms, 0);
+}
+
+void smtimer_start_periodic(SMT_ID id, uint32_t periodMs) {
+    smtimer_set(id, periodMs, os_time_ms_to_ticks32(periodMs));
+}
+
+void smtimer_stop(SMT_ID id) {
+    // most transitions have nothing to stop, don't touch the callout then
+    if ((_smt.running & (1<<id))==0) {
+        return;
+    }
+    _smt.running &= ~(1<<id);
+    smtimer_rearm();
+}
+
+bool smtimer_running(SMT_ID id) {
+    return ((_smt.running & (1<<id))!=0);
+}
+
+uint32_t smtimer_remaining(SMT_ID id) {
+    if (!smtimer_running(id)) {
+        return 0;
+    }
+    int32_t delta = (int32_t)(_smt.due[id]-os_time_get());
+    return (delta>0)?os_time_ticks_to_ms32(delta):0;
+}
@@ -0,0 +1,179 @@
+/**
+ Wyres private code
+ State machine transition trace : ring in no-init RAM, CRC sealed before reboot, flushed to the reboot log area after.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "os/os.h"
+#include "bsp/bsp.h"
+#include "console/console.h"
+#include "crc/crc16.h"
+#include "flash_map/flash_map.h"
+#include "sysflash/sysflash.h"
+
+#include "wutils.h"
+#include "smtrace.h"
+#include "smreplay.h"
+
+#define SMTRACE_SZ          MYNEWT_VAL(SM_TRACE_SIZE)         // power of 2
+#define SMTRACE_MAGIC       (0x534d5402)                        // 'SMT' + layout version
+#define SMTRACE_FLUSH_MS    MYNEWT_VAL(SM_TRACE_FLUSH_DELAY_MS)
+
+#if (SMTRACE_SZ & (SMTRACE_SZ-1))!=0
+#error "SM_TRACE_SIZE must be a power of 2"
+#endif
+
+static struct {
+    uint32_t magic;
+    uint16_t next;          // index of next record to write (free running)
+    uint16_t crc;           // over recs and next, valid only once sealed
+    SM_TRACE_REC_t recs[SMTRACE_SZ];
+} bssnz_t _smTrace;
+
+// Trace block in the reboot log flash area : this header, followed by the records oldest first.
+// Blocks go in fixed slots that never straddle an erase unit, used as a ring : entering an erase unit
+// erases it, dropping only the oldest traces.
+typedef struct {
+    uint32_t magic;
+    uint16_t seq;           // +1 per block written, the highest (modulo 2^16) is the newest
+    uint16_t nrecs;
+    uint16_t crc;           // over the records
+    uint16_t rsvd;
+} SM_TRACE_FLASH_HDR_t;
+
+#define SMTRACE_ERASE_SZ    MYNEWT_VAL(SM_TRACE_ERASE_SIZE)
+#define SMTRACE_BLK_SZ      (sizeof(SM_TRACE_FLASH_HDR_t)+sizeof(_smTrace.recs))
+
+// The ring of the previous run, copied aside at boot (the live one goes on recording) until it is flushed
+static SM_TRACE_REC_t _sealedRecs[SMTRACE_SZ];
+static struct os_callout _flushTimer;
+
+static uint16_t smtrace_crc(void) {
+    uint16_t crc = crc16_ccitt(CRC16_INITIAL_CRC, &_smTrace.next, sizeof(_smTrace.next));
+    return crc16_ccitt(crc, _smTrace.recs, sizeof(_smTrace.recs));
+}
+
+// Is the block slot blank (whatever the erased value of the flash is)?
+static bool smtrace_slot_erased(const struct flash_area* fa, uint32_t off) {
+    uint8_t buf[32];
+    uint8_t erased = 0;
+    for(uint32_t i=0;i<SMTRACE_BLK_SZ;i+=sizeof(buf)) {
+        uint32_t n = ((SMTRACE_BLK_SZ-i)<sizeof(buf))?(SMTRACE_BLK_SZ-i):sizeof(buf);
+        if (flash_area_read(fa, off+i, buf, n)!=0) {
+            return false;
+        }
+        if (i==0) {
+            erased = buf[0];
+            if (erased!=0x00 && erased!=0xff) {
+                return false;
+            }
+        }
+        for(uint32_t j=0;j<n;j++) {
+            if (buf[j]!=erased) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void smtrace_flush(struct os_event* ev) {
+    const struct flash_area* fa;
+    if (flash_area_open(FLASH_AREA_REBOOT_LOG, &fa)!=0) {
+        console_printf("sm trace : no reboot log area\r\n");
+        return;
+    }
+    uint32_t perErase = SMTRACE_ERASE_SZ/SMTRACE_BLK_SZ;
+    uint32_t nslots = (fa->fa_size/SMTRACE_ERASE_SZ)*perErase;
+    if (perErase==0 || nslots<2*perErase) {
+        console_printf("sm trace : reboot log area too small\r\n");
+        flash_area_close(fa);
+        return;
+    }
+    // find the newest block
+    SM_TRACE_FLASH_HDR_t hdr;
+    bool found = false;
+    uint16_t seq = 0;
+    uint32_t slot = 0;
+    for(uint32_t s=0;s<nslots;s++) {
+        uint32_t off = (s/perErase)*SMTRACE_ERASE_SZ + (s%perErase)*SMTRACE_BLK_SZ;
+        if (flash_area_read(fa, off, &hdr, sizeof(hdr))==0 && hdr.magic==SMTRACE_MAGIC &&
+                (!found || (int16_t)(hdr.seq-seq)>0)) {
+            found = true;
+            seq = hdr.seq;
+            slot = s;
+        }
+    }
+    if (found) {
+        slot = (slot+1)%nslots;
+        seq++;
+    }
+    uint32_t off = (slot/perErase)*SMTRACE_ERASE_SZ + (slot%perErase)*SMTRACE_BLK_SZ;
+    if ((slot%perErase)!=0 && !smtrace_slot_erased(fa, off)) {
+        // left over by a flush cut short : go on in the next erase unit
+        slot = ((slot/perErase+1)*perErase)%nslots;
+        off = (slot/perErase)*SMTRACE_ERASE_SZ;
+    }
+    if ((slot%perErase)==0 && flash_area_erase(fa, off, SMTRACE_ERASE_SZ)!=0) {
+        console_printf("sm trace : erase failed\r\n");
+        flash_area_close(fa);
+        return;
+    }
+    hdr.magic = SMTRACE_MAGIC;
+    hdr.seq = seq;
+    hdr.nrecs = SMTRACE_SZ;
+    hdr.crc = crc16_ccitt(CRC16_INITIAL_CRC, _sealedRecs, sizeof(_sealedRecs));
+    hdr.rsvd = 0;
+    if (flash_area_write(fa, off+sizeof(hdr), _sealedRecs, sizeof(_sealedRecs))==0 &&
+        flash_area_write(fa, off, &hdr, sizeof(hdr))==0) {
+        console_printf("sm trace %d flushed to reboot log at %lu\r\n", seq, (unsigned long)off);
+    } else {
+        console_printf("sm trace flush failed\r\n");
+    }
+    flash_area_close(fa);
+}
+
+void smtrace_init(void) {
+    if (_smTrace.magic==SMTRACE_MAGIC && _smTrace.crc==smtrace_crc()) {
+        // trace of the previous run : keep it going, and save a copy of it (in time order, the oldest
+        // is at next) once things have settled
+        for(int i=0;i<SMTRACE_SZ;i++) {
+            _sealedRecs[i] = _smTrace.recs[(_smTrace.next+i) & (SMTRACE_SZ-1)];
+        }
+        os_callout_init(&_flushTimer, os_eventq_dflt_get(), smtrace_flush, NULL);
+        os_callout_reset(&_flushTimer, os_time_ms_to_ticks32(SMTRACE_FLUSH_MS));
+    } else {
+        memset(&_smTrace, 0, sizeof(_smTrace));
+        _smTrace.magic = SMTRACE_MAGIC;
+    }
+    // invalidate the seal until next controlled reboot
+    _smTrace.crc = ~_smTrace.crc;
+    smtrace_add(0, SMTRACE_BOOT, 0, 0);
+}
+
+void smtrace_add(uint8_t from, uint8_t event, uint32_t data, uint8_t to) {
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    SM_TRACE_REC_t* r = &_smTrace.recs[(_smTrace.next++) & (SMTRACE_SZ-1)];
+    OS_EXIT_CRITICAL(sr);
+    r->tick = sm_time_get();
+    r->from = from;
+    r->event = event;
+    r->data = data;
+    r->to = to;
+}
+
+void smtrace_seal(void) {
+    _smTrace.crc = smtrace_crc();
+}
+
+void smtrace_dump(void) {
+    for(int i=0;i<SMTRACE_SZ;i++) {
+        SM_TRACE_REC_t* r = &_smTrace.recs[(_smTrace.next+i) & (SMTRACE_SZ-1)];
+        if (r->tick!=0 || r->event!=0) {
+            console_printf("%10lu : %2d -(%3d,%3d)-> %2d\r\n", (unsigned long)r->tick, r->from, r->event, r->data, r->to);
+        }
+    }
+}
@@ -26,23 +26,98 @@
 #include "main.h"
 #include "adc.h"
 #include "LoRa_message.h"
+#include "smstats.h"
+#include "smtrace.h"
+#include "smreplay.h"
+#include "smtimer.h"
+#include "payload.h"
+#include "aggreg.h"
+#include "appcfg.h"
+#include "joinsched.h"
+#include "journal.h"
+#include "keepalive.h"
 
 /*Define task stack of the state machine*/
 #define MY_SM_TASK_PRIO        MYNEWT_VAL(STATE_MACH_TASK_PRIO)
 #define MY_SM_TASK_STACK_SZ    MYNEWT_VAL(STATE_MACH_STACK_SIZE)
+#define SM_MAX_CHAIN           MYNEWT_VAL(SM_MAX_TRANSITION_CHAIN)
+#define HALL_SETTLE_MS         MYNEWT_VAL(HALL_DEBOUNCE_MS)
 
 
-// callout & queue
-static struct os_callout _sm_timer;
+// queue
 static struct os_eventq _sm_eq;
 
 static os_stack_t my_sm_task_stack[MY_SM_TASK_STACK_SZ];
 static struct os_task my_sm_task_str;
 
-static EVENT _zeEvent;
-static void* _zeData;
+/*
+ * Event ring : sendEvent() may be called from ISRs, the loraapp task and callouts, so
+ * records are pushed with interrupts masked for a few stores only (no mutex, never blocks).
+ * The single _sm_evt is on _sm_eq whenever the ring is not empty, and its callback drains
+ * the ring in order.
+ */
+#define SM_EVQ_SZ       MYNEWT_VAL(SM_EVENT_QUEUE_SIZE)
+typedef struct {
+    EVENT e;
+    void* data;
+    uint32_t ts;            // os_cputime when posted
+} SM_EVT_REC_t;
+
+static SM_EVT_REC_t _smEvQ[SM_EVQ_SZ];
+static uint8_t _smEvQHead=0;        // next record to dispatch
+static uint8_t _smEvQCount=0;
+static struct {
+    uint32_t posted;
+    uint32_t overflows;     // events refused because ring was full
+    uint32_t reported;      // overflows already logged
+    uint8_t maxDepth;
+    uint32_t maxLatencyUs;  // worst post to dispatch delay
+} _smEvQStats;
+
+// A state action processes one event and returns the next state (or CURRENT_STATE)
+typedef STATE (*SM_ACTION_t)(void* data);
+
+// LEDs cancelled on EXIT
+#define SM_LED_ORANGE   (0x01)
+#define SM_LED_RED      (0x02)
+
+/*
+ * Super states : the ST_* (test door) and OP_* (operational) states share behaviour which is 
+ * defined once in their parent. An event a state does not process is passed to its parent.
+ * Parent EXIT/ENTER only run when the transition leaves/enters the group.
+ */
+#define SM_NO_PARENT    (NOTINIT)       // NOTINIT is never a parent
+#define SM_SUPER_OP     (SM_NB_STATES)
+#define SM_SUPER_ST     (SM_NB_STATES+1)
+#define SM_NB_DESCS     (SM_NB_STATES+2)
+
+// State descriptor : entry/exit/timeout and event actions for one state
+typedef struct {
+    SM_ACTION_t actions[SM_NB_EVENTS];
+    uint32_t timeoutMs;
+    uint8_t timer;                      // SMT_xxx timer carrying timeoutMs
+    uint8_t timeoutCfg;                 // APPCFG_xxx giving timeoutMs instead, if not APPCFG_NONE
+    bool timeoutTx;                     // timeout is the time the frame queued by ENTER may take, instead
+    uint8_t exitLeds;
+    uint8_t parent;
+    const struct sm_signal* signal;     // for the ST_SIGNAL_xxx family
+} SM_STATE_DESC_t;
+
+// ST_SIGNAL_TIMEOUT, ST_SIGNAL_ERROR and ST_TRIES_ERROR only differ by these
+struct sm_signal {
+    uint8_t led;                // SM_LED_xxx
+    const char* pattern;
+    uint8_t durSecs;
+    const char* msg;
+    int (*getTries)();          // NULL if no retry count
+    int (*incTries)();
+    STATE onTooManyTries;
+};
 
 static STATE statemachine(EVENT e, void* data); 
+static void sm_exit(STATE next);
+static STATE sm_enter(STATE prev);
+static const SM_STATE_DESC_t _smStates[SM_NB_DESCS];
 
 
 /* For LED toggling */
@@ -51,27 +126,57 @@ static int8_t g_led_red = LED_D2;
 static int8_t g_button_pin = BUTTON_PIN;
 static int8_t g_hall_pin = HALL_EFFECT;
 
-/*Send different payloads for cage state*/
-// cage Id (devEUI), opened/closed, battery, temperature
-static uint16_t payload [5] = {0x0000, 0x0002, 0x0000, 0x0000};
+/* Uplink frame, packed from the payload schema (payload.h) */
+static uint8_t _txFrame[PAYLOAD_MAX_SZ];
+static uint8_t _txFrameSz = 0;
+// aggregated records in the frame, dropped from the aggregator once it is acked
+static uint8_t _txAggCount = 0;
+// journal sequence numbers of its door records
+static struct {
+    uint8_t n;
+    uint16_t first;
+    uint16_t last;
+} _txDoors;
+static uint8_t _txReason = PL_REASON_HEARTBEAT;
+static uint16_t _txBatt = 0;            // battery reading it carries
+static bool _hbCheck = false;           // the next heartbeat checks the link
+static uint8_t _txFrameId = 0;          // of the last frame queued, the one whose result we wait for
+static uint32_t _txTimeoutMs = 0;       // longest its result may take
 
 
 /*Globale variable*/
 static STATE _currentState = NOTINIT;
 
-static void my_button_ev_cb(struct os_event *);
-static void my_hall_ev_cb(struct os_event *);
 static void sm_evt_cb(struct os_event *); 
-static void sm_timer_stop(void); 
+
+// Event sent when each named timer expires
+static const EVENT _smTimerEvents[SMT_NB_TIMERS] = {
+    [SMT_STATE] = TIMEOUT,
+    [SMT_HEARTBEAT] = TIMEOUT_HEARTBEAT,
+    [SMT_RETRY] = TIMEOUT_RETRY,
+    [SMT_LED_CONFIRM] = TIMEOUT_LED,
+    [SMT_AGGREGATE] = TIMEOUT_AGG,
+};
+// heartbeat or end of aggregation window fell while we were busy elsewhere : sent when back in OP_WAITING
+static bool _txPending = false;
+
+// The application parameters as the state machine sees them : all read at start, then the ones a downlink
+// changed (LORA_RX). Reading them goes through SM_INPUT_ID(), so a capture records them only then.
+static uint32_t _smCfg[APPCFG_NB];
 
 
 /* Decalare and initialize the event with the callback function*/
-static struct os_event gpio_ev0 = {
-    .ev_cb = my_button_ev_cb,
-};
-static struct os_event gpio_ev1 = {
-    .ev_cb = my_hall_ev_cb,
-};
+
+/*
+ * Hall sensor debounce : every edge (re)starts the settle timer, so a burst of bounces or a
+ * vibrating cage only produces one IRQ_HALL, carrying the settled level, once the pin has been
+ * quiet for HALL_DEBOUNCE_MS. Nothing is sent if it settled back to the level already signalled.
+ */
+static struct os_callout _hall_settle;
+static int _hallLevel = -1;             // last level signalled
+static uint16_t _hallEdges = 0;         // edges in the current burst
+static int _hallEdgeLevel;              // level and time sampled in the ISR at the last edge
+static uint32_t _hallEdgeTs;
 
 static struct os_event _sm_evt = {
     .ev_cb = sm_evt_cb,
@@ -79,39 +184,110 @@ static struct os_event _sm_evt = {
 
 
 
+// Lowest free stack seen for the sm task (in words)
+static uint16_t _smStackFree=MY_SM_TASK_STACK_SZ;
+
+// Stack grows down from the top of my_sm_task_stack, os_task_init() filled it with OS_STACK_PATTERN
+static uint16_t sm_stack_free(void) 
+{
+    uint16_t i=0;
+    while (i<_smStackFree && my_sm_task_stack[i]==OS_STACK_PATTERN) 
+    {
+        i++;
+    }
+    _smStackFree = i;
+    return i;
+}
+
+/*
+ * Run to completion : EXIT the current state, ENTER the new one, and loop while ENTER
+ * asks for another transition (eg STARTING->OP_WAITING). Iterative so stack use does not
+ * depend on the chain length, which is bounded by SM_MAX_TRANSITION_CHAIN to catch loops.
+ */
 static STATE changeState(STATE n) 
 {
-    if (n==CURRENT_STATE) 
+    uint8_t chain = 0;
+    while (n!=CURRENT_STATE) 
     {
-        return _currentState;
+        if (chain>=SM_MAX_CHAIN) 
+        {
+            smstats_chain_abort();
+            console_printf("transition chain too long, staying in state %d (wanted %d)\r\n", _currentState, n);
+            break;
+        }
+        chain++;
+        console_printf("Leaving state %d, entering state %d\r\n", _currentState, n);
+        uint32_t t0 = os_cputime_get32();
+        sm_exit(n);
+        STATE prev = _currentState;
+        _currentState = n;
+        n = sm_enter(prev);
+        smstats_transition(prev, _currentState, os_cputime_ticks_to_usecs(os_cputime_get32()-t0));
     }
-    else
+    if (chain>0) 
     {
-        //oops
+        smstats_chain(chain, MY_SM_TASK_STACK_SZ-sm_stack_free());
     }
-    console_printf("Leaving state %d, entering state %d\r\n", _currentState, n);
-    sm_timer_stop();
-    statemachine(EXIT, NULL);
-    _currentState = n;
-    changeState(statemachine(ENTER, NULL));
     return _currentState;
 }
 
 
-static void sm_timer_start(uint32_t t) 
+static void sm_timer_start(SMT_ID id, uint32_t ms) 
+{
+    if (smreplay_active()) 
+    {
+        // timer events come from the replayed stream
+        return;
+    }
+    smtimer_start(id, ms);
+}
+static void sm_timer_periodic(SMT_ID id, uint32_t ms) 
+{
+    if (smreplay_active()) 
+    {
+        return;
+    }
+    smtimer_start_periodic(id, ms);
+}
+
+
+static void sm_cfg_load(uint32_t changed) 
 {
-    // create callout calling the cb executed on default q
-    os_callout_reset(&_sm_timer, ((t*OS_TICKS_PER_SEC)/1000));
+    for(int p=APPCFG_NONE+1;p<APPCFG_NB;p++) 
+    {
+        if (changed & APPCFG_BIT(p)) 
+        {
+            _smCfg[p] = SM_INPUT_ID(SMIN_CFG, p, appcfg_get(p));
+        }
+    }
 }
-static void sm_timer_stop(void) 
+
+uint32_t sm_cfg_get(uint8_t p) 
 {
-    os_callout_stop(&_sm_timer);
+    assert(p>APPCFG_NONE && p<APPCFG_NB);
+    return _smCfg[p];
 }
 
+// Dispatch one event and run the resulting transitions, tracing it
+static void sm_dispatch(EVENT e, void* data) 
+{
+    STATE from = _currentState;
+    smcapture_event(e, (uint32_t)(uintptr_t)data);
+    if (e==LORA_RX) 
+    {
+        // whatever the state, before any action uses them
+        sm_cfg_load((uint32_t)(uintptr_t)data);
+    }
+    STATE next = statemachine(e, data);
+    smtrace_add(from, e, (uint32_t)(uintptr_t)data, (next==CURRENT_STATE)?from:next);
+    changeState(next);    // between two dispatches the state is complete : a replay can start here
+    smcapture_snapshot();
+}
 
-static void sm_callout_cb(struct os_event *ev) 
+// Runs in the sm task (the timer callout is on _sm_eq)
+static void sm_timer_expired(SMT_ID id) 
 {
-    changeState(statemachine(TIMEOUT, NULL));
+    sm_dispatch(_smTimerEvents[id], NULL);
 }
 
 
@@ -122,50 +298,110 @@ static void my_sm_task(void *arg)
         os_eventq_run(&_sm_eq);
     }
 }
-void 
-sendEvent(EVENT e, void* data) 
+// ISR safe : may be called from any context. ts is the os_cputime of the input.
+static void sm_post(EVENT e, void* data, uint32_t ts) 
 {
-    if (_sm_evt.ev_queued==false) 
+    if (smreplay_active()) 
     {
-        _zeEvent=e;
-        _zeData=data;
-        os_eventq_put(&_sm_eq, &_sm_evt);
-    } 
-    else 
+        // only the replayed events are fed in
+        return;
+    }
+    os_sr_t sr;
+    OS_ENTER_CRITICAL(sr);
+    if (_smEvQCount>=SM_EVQ_SZ) 
+    {
+        // full : counted and reported by the sm task, never silently dropped
+        _smEvQStats.overflows++;
+        OS_EXIT_CRITICAL(sr);
+        return;
+    }
+    SM_EVT_REC_t* r = &_smEvQ[(_smEvQHead+_smEvQCount)%SM_EVQ_SZ];
+    r->e = e;
+    r->data = data;
+    r->ts = ts;
+    _smEvQCount++;
+    _smEvQStats.posted++;
+    if (_smEvQCount>_smEvQStats.maxDepth) 
     {
-        //oops
-        console_printf("failed to q sm event %d as already on q\r\n", e);
+        _smEvQStats.maxDepth = _smEvQCount;
     }
+    OS_EXIT_CRITICAL(sr);
+    // does nothing if already queued
+    os_eventq_put(&_sm_eq, &_sm_evt);
 }
 
-static void sm_evt_cb(struct os_event *ev) 
+// ISR safe : may be called from any context
+void 
+sendEvent(EVENT e, void* data) 
 {
-    changeState(statemachine(_zeEvent, _zeData));
+    sm_post(e, data, os_cputime_get32());
 }
 
-
-static void my_button_ev_cb(struct os_event *ev)
+static void sm_evt_cb(struct os_event *ev) 
 {
-    assert(ev!=NULL);
-    sendEvent(IRQ_BUTT, NULL);
+    SM_EVT_REC_t r;
+    os_sr_t sr;
+    while(1) 
+    {
+        OS_ENTER_CRITICAL(sr);
+        if (_smEvQCount==0) 
+        {
+            OS_EXIT_CRITICAL(sr);
+            break;
+        }
+        r = _smEvQ[_smEvQHead];
+        _smEvQHead = (_smEvQHead+1)%SM_EVQ_SZ;
+        _smEvQCount--;
+        OS_EXIT_CRITICAL(sr);
+
+        uint32_t lat = os_cputime_ticks_to_usecs(os_cputime_get32()-r.ts);
+        if (lat>_smEvQStats.maxLatencyUs) 
+        {
+            _smEvQStats.maxLatencyUs = lat;
+        }
+        sm_dispatch(r.e, r.data);
+    }
+    if (_smEvQStats.overflows!=_smEvQStats.reported) 
+    {
+        console_printf("sm event q full : lost %lu events (max depth %d)\r\n", 
+            (unsigned long)(_smEvQStats.overflows-_smEvQStats.reported), _smEvQStats.maxDepth);
+        smstats_evq_overflow(_smEvQStats.overflows-_smEvQStats.reported);
+        _smEvQStats.reported = _smEvQStats.overflows;
+    }
 }
-static void my_hall_ev_cb(struct os_event *ev)
+
+
+static void my_hall_settled_cb(struct os_event *ev)
 {
-    assert(ev!=NULL);
-    sendEvent(IRQ_HALL, NULL);
+    // no edge since the last one was sampled, so its level is the settled one
+    int level = _hallEdgeLevel;
+    if (level!=_hallLevel) 
+    {
+        console_printf("hall settled at %d after %d edges\r\n", level, _hallEdges);
+        _hallLevel = level;
+        sm_post(IRQ_HALL, (void*)(uintptr_t)level, _hallEdgeTs);
+    }
+    _hallEdges = 0;
 }
 
 
+/*
+ * The IRQ handlers sample the pin (direct hal read : GPIO_read() takes the gpiomgr mutex)
+ * and the time, and post straight into the state machine ring.
+ */
 static void
 my_button_irq(void *arg)
 {
-    os_eventq_put(&_sm_eq, &gpio_ev0);
+    sm_post(IRQ_BUTT, (void*)(uintptr_t)hal_gpio_read(g_button_pin), os_cputime_get32());
 }
 
 static void 
 my_hall_irq(void *arg)
 {
-    os_eventq_put(&_sm_eq, &gpio_ev1);
+    _hallEdgeTs = os_cputime_get32();
+    _hallEdgeLevel = hal_gpio_read(g_hall_pin);
+    _hallEdges++;
+    os_callout_reset(&_hall_settle, os_time_ms_to_ticks32(HALL_SETTLE_MS));
 }
  
 
@@ -173,7 +409,22 @@ my_hall_irq(void *arg)
 void 
 start_statemachine(void) 
 {
-    payload[0]=lora_getId();
+    smstats_init();
+    smtrace_init();
+    smcapture_init();
+    smcapture_state(&_currentState, sizeof(_currentState));
+    smcapture_state(&_txPending, sizeof(_txPending));
+    smcapture_state(&_txAggCount, sizeof(_txAggCount));
+    smcapture_state(_smCfg, sizeof(_smCfg));
+    // the result awaited, and the timeout of the tx states, may span a snapshot
+    smcapture_state(&_txFrameId, sizeof(_txFrameId));
+    smcapture_state(&_txTimeoutMs, sizeof(_txTimeoutMs));
+    smcapture_state(&_hbCheck, sizeof(_hbCheck));
+    aggreg_init();
+    keepalive_init();
+#if MYNEWT_VAL(SM_REPLAY)
+    smreplay_init();
+#endif
 
     // init q, event
     /* Use a dedicate event queue for timer and interrupt events */
@@ -198,10 +449,37 @@ start_statemachine(void)
      * The my_timer_ev_cb callback function processes the timer event.
      */
 
-    os_callout_init(&_sm_timer, &_sm_eq, sm_callout_cb, NULL);
+    smtimer_init(&_sm_eq, sm_timer_expired);
+    // the DevEUI makes each node draw its own join times
+    joinsched_init(((uint32_t)lora_getId()<<16) ^ (uint32_t)os_get_uptime_usec());
+    os_callout_init(&_hall_settle, &_sm_eq, my_hall_settled_cb, NULL);
 
-    // start up state machine, firstly join attempt
-    changeState(JOINING);
+#if MYNEWT_VAL(SM_REPLAY)
+    // from the snapshot the stream starts with, else from boot as below
+    if (smreplay_snapshot()) 
+    {
+        // never returns
+        smreplay_run();
+    }
+#endif
+    sm_cfg_load(~0u);
+    // start up state machine : carry on with the saved session, else join first
+    changeState(SM_INPUT(SMIN_SESSION, lora_app_resumed())?STARTING:JOINING);
+#if MYNEWT_VAL(SM_REPLAY)
+    // never returns
+    smreplay_run();
+#endif
+}
+
+STATE sm_get_state(void) 
+{
+    return _currentState;
+}
+
+STATE sm_inject(EVENT e, void* data) 
+{
+    sm_dispatch(e, data);
+    return _currentState;
 }
 
 
@@ -228,550 +506,662 @@ init_tasks(void)
     ledRequest (g_led_red, ON, 4, LED_REQ_INTERUPT);
 }
 
+/*
+ * State actions. Each returns the next state, or CURRENT_STATE to stay put.
+ * They are referenced from the const state table below, which replaces the old
+ * switch(state){switch(event)} : dispatch is a single indexed lookup.
+ */
 
+// State machine inputs all go through SM_INPUT() so they can be captured and replayed
+static int sm_read_hall(void) 
+{
+    return SM_INPUT(SMIN_HALL, GPIO_read(g_hall_pin));
+}
+static uint16_t sm_read_battery(void) 
+{
+    return SM_INPUT(SMIN_BATT, BoardBatteryMeasureVolage());
+}
+// Status frames replace each other in the lora tx queue if not sent yet
+static uint32_t sm_lora_tx_queue(LORA_MSG_CLASS_t cls) 
+{
+    uint8_t id = 0;
+    LORA_TX_RESULT_t ret = lora_app_tx(_txFrame, _txFrameSz, cls, LORA_KEY_STATUS, LORA_TX_TIMEOUT_AUTO, &id);
+    return ((uint32_t)id<<8) | ret;
+}
+static LORA_TX_RESULT_t sm_lora_tx(LORA_MSG_CLASS_t cls) 
+{
+    // at the current data rate, with a diag or backlog frame that may be on air before it, once the duty cycle
+    // lets it go : a frame held in the queue is late, not lost
+    _txTimeoutMs = SM_INPUT(SMIN_TXTIME, lora_app_tx_hold_ms(_txFrameSz, cls) + lora_app_tx_timeout_ms(_txFrameSz, cls) 
+        + lora_app_tx_timeout_ms(LORA_DIAG_MAX_SZ, LORA_MSG_BACKLOG));
+    // the frame id is an input too, as results are matched against it
+    uint32_t ret = SM_INPUT(SMIN_TXRET, sm_lora_tx_queue(cls));
+    _txFrameId = (ret>>8) & 0xff;
+    return (LORA_TX_RESULT_t)(ret & 0xff);
+}
+// Result in LORA_TX_STATUS data. Returns false if it is for an older frame (replaced, or given up on) : 
+// it must not be taken for the result of the one we wait for.
+static bool sm_tx_result(void* data, LORA_TX_RESULT_t* result) 
+{
+    uint8_t id = ((uintptr_t)data>>8) & 0xff;
+    *result = (LORA_TX_RESULT_t)((uintptr_t)data & 0xff);
+    if (id!=_txFrameId) 
+    {
+        console_printf("tx result %d for frame %d ignored, waiting for frame %d\r\n", *result, id, _txFrameId);
+        return false;
+    }
+    return true;
+}
 
+// Build the uplink frame with a fresh battery reading. No temperature sensor yet, so PL_TEMP is left out.
+static void sm_build_frame(uint8_t reason, int door) 
+{
+    PAYLOAD_t pl;
+    uint16_t batt = sm_read_battery();
+    payload_init(&pl);
+    payload_set(&pl, PL_REASON, reason);
+    payload_set(&pl, PL_DOOR, door);
+    payload_set(&pl, PL_BATTERY, batt);
+    _txReason = reason;
+    _txBatt = batt;
+    _txAggCount = aggreg_fill(&pl);
+    _txDoors.n = aggreg_filled_doors(&_txDoors.first, &_txDoors.last);
+    _txFrameSz = payload_encode(&pl, _txFrame, sizeof(_txFrame));
+    console_printf("level battery = %d mV, %d records \r\n", batt, _txAggCount);
+    console_printf("payload =");
+    for(int i=0;i<_txFrameSz;i++) 
+    {
+        console_printf(" %02x", _txFrame[i]);
+    }
+    console_printf("\r\n");
+}
 
+static int8_t sm_led(uint8_t led) 
+{
+    return (led==SM_LED_ORANGE)?g_led_orange:g_led_red;
+}
 
+// Door LEDs for the hall level : red is on while the cage is closed. In OP mode the orange is also cleared.
+static int door_leds(bool clearOrange, int level) 
+{
+    if (clearOrange) 
+    {
+        ledCancel(g_led_orange);
+    }
+    if (level==0)
+    {
+        ledCancel(g_led_red);
+        console_printf("Cage opened !! \r\n");
+    }
+    else
+    {
+        ledRequest(g_led_red, ON, 30, LED_REQ_INTERUPT);
+        console_printf("Cage closed !! \r\n");
+    }
+    return level;
+}
 
-static STATE statemachine(EVENT e, void* data) 
+// The journal is in flash : a replay leaves it alone
+static uint16_t sm_journal_add(int door) 
 {
-    switch(_currentState) 
+    if (smreplay_active()) 
     {
-        case NOTINIT: 
-        {
-            return CURRENT_STATE;
-        }
-        case JOINING:
-        {
-            switch(e) 
-            {
-                case ENTER:
-                {
-                    // send LoRa message
-                    payload[2]=BoardBatteryMeasureVolage();
-                    console_printf("level battery = %d mV \r\n",payload[2]);
-                    console_printf("payload = %04x %04x %04x %04x\r\n", payload[0],payload[1],payload[2], payload[3]);
-                    lora_app_tx(payload, sizeof(payload), 8000);
-                    sm_timer_start(20000);
-                    ledRequest(g_led_red, FLASH_4HZ, 0, LED_REQ_INTERUPT);
-                    return CURRENT_STATE;
-                }
-                case EXIT: {
-                    sm_timer_stop();
-                    ledCancel(g_led_red);
-                    return CURRENT_STATE;
-                }
-                case TIMEOUT: {
-                    console_printf("JOIN sent but no result, retry\r\n");
-                    payload[2]=BoardBatteryMeasureVolage();
-                    console_printf("level battery = %d mV \r\n",payload[2]);
-                    console_printf("payload = %04x %04x %04d %04x\r\n", payload[0],payload[1],payload[2], payload[3]);
-                    lora_app_tx(payload, sizeof(payload), 8000);
-                    sm_timer_start(300000);
-                    return CURRENT_STATE;
-                }
-                case LORA_TX_STATUS:
-                {
-                    // status in data
-                    // deal with it
-                    LORA_TX_RESULT_t result = (LORA_TX_RESULT_t)data;
-                    if (result==LORA_TX_OK_ACKD) 
-                    {
-                        console_printf("JOIN/SEND/RX ok, starting\r\n");
-                        return STARTING;
-                    } 
-                    else if (result==LORA_TX_ERR_FATAL) 
-                    {
-                        console_printf("All bad, reboot\r\n");
-                        return FATAL_ERROR;
-                    }
-                    // else the timer will retry in a bit
-                    return CURRENT_STATE;
-
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
+        return 0;
+    }
+    return journal_add(door);
+}
+// A frame built from the aggregator was acked : its door events are in, and the link is back for the backlog
+static void sm_journal_acked(void) 
+{
+    if (smreplay_active()) 
+    {
+        return;
+    }
+    if (_txDoors.n>0) 
+    {
+        journal_delivered(_txDoors.first, _txDoors.last);
+    }
+    if (aggreg_count()==0) 
+    {
+        journal_drain();
+    }
+}
 
-        case STARTING:
-        {
-            switch(e) 
-            {
-                case ENTER:
-                {
-                    // init stuff
-                    init_tasks();
-                    return OP_WAITING;
-                }
-
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case OP_WAITING:
-        {
-            switch(e) 
-            {
-                case ENTER:
-                {
-                    sm_timer_start(300000);
-                    return CURRENT_STATE;
-                }
-                case TIMEOUT:
-                {
-                    sm_timer_stop();
-                    return OP_TX_AND_WAIT_RESULT;
-                }
-                case IRQ_BUTT:
-                {
-                    return ST_TEST_DOOR;
-                }
-                case IRQ_HALL: 
-                {
-                    // check hall input and set led appropriately
-                    // TODO
-                    if (GPIO_read(g_hall_pin)==0)
-                    {
-                        ledCancel(g_led_orange);            
-                        ledCancel(g_led_red);
-                        console_printf("Cage opened !! \r\n");
-                        if (get_current_data()!=0) {
-                            set_current_data(0);
-                            // State change so LoRa message sent
-                            return OP_TX_AND_WAIT_RESULT;
-                        }
-                    }
-                    else if (GPIO_read(g_hall_pin)==1)
-                    {
-                        ledCancel(g_led_orange);                    
-                        ledRequest(g_led_red, ON, 30, LED_REQ_INTERUPT);
-                        console_printf("Cage closed !! \r\n");
-                        if (get_current_data()!=1) {
-                            set_current_data(1);
-                            // State change so LoRa message sent
-                            return OP_TX_AND_WAIT_RESULT;
-                        }
-                    }
-                    return CURRENT_STATE;
-                }
-
-                default: 
-                {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case OP_TX_AND_WAIT_RESULT:
-        {
-            switch(e) 
-            {
-                case ENTER:
-                {
-                    if (GPIO_read(g_hall_pin)==0)
-                    {
-                        // send LoRa message
-                        payload[1]=0x0001;
-                        payload[2]=BoardBatteryMeasureVolage();
-                        console_printf("level battery = %d",payload[2]);
-                        console_printf("payload = %02x%02x%02x%02x\r\n", payload[0],payload[1],payload[2], payload[3]);
-                        if (lora_app_tx(payload, sizeof(payload), 10000)==LORA_TX_OK) {
-                            sm_timer_start(20000);
-                            return CURRENT_STATE;
-                        }
-                        return OP_SIGNAL_ERROR;
-                    }
-                    if (GPIO_read(g_hall_pin)==1)
-                    {
-                        // send LoRa message
-                        payload[1]=0x0000;
-                        payload[2]=BoardBatteryMeasureVolage();
-                        console_printf("level battery = %d mV \r\n",payload[2]);
-                        console_printf("payload = %02x%02x%02x%02x\r\n", payload[0],payload[1],payload[2], payload[3]);
-                        if (lora_app_tx(payload, sizeof(payload), 10000)==LORA_TX_OK) {
-                            sm_timer_start(20000);
-                            return CURRENT_STATE;
-                        }
-                        return OP_SIGNAL_ERROR;
-                    }                    
-                }
-                case TIMEOUT:
-                {
-                    // no answer
-                    return OP_SIGNAL_TIMEOUT;
-                }
-                case LORA_TX_STATUS:
-                {
-                    // status in data
-                    // deal with it
-                    LORA_TX_RESULT_t result = (LORA_TX_RESULT_t)data;
-                    if (result==LORA_TX_OK_ACKD) 
-                    {
-                        return OP_SIGNAL_OK;
-                    } 
-                    else if (result==LORA_TX_TIMEOUT) 
-                    {
-                        return OP_SIGNAL_TIMEOUT;
-                    }  
-                    else 
-                    {
-                        return OP_SIGNAL_ERROR;
-                    }
-                    return CURRENT_STATE;
-
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case OP_SIGNAL_OK:
-        {
-            switch(e) 
-            {
-                case ENTER :
-                {
-                    ledRequest(g_led_orange, ON, 10, LED_REQ_INTERUPT);
-                    return OP_WAITING;
-                } 
-
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }   
-        case OP_SIGNAL_TIMEOUT:
-        case OP_SIGNAL_ERROR:
-        {
-            switch(e) 
-            {
-                case ENTER : 
-                {
-                    ledRequest(g_led_orange, FLASH_4HZ, 10, LED_REQ_INTERUPT);
-                    if (get_current_data()==0) 
-                    {
-                        // ok too bad
-                        return OP_WAITING;
-                    } else {
-                        // retry in 10s
-                        sm_timer_start(10000);
-                        return CURRENT_STATE;
-                    }               
-                }
-                case EXIT : 
-                {
-                    sm_timer_stop();
-                    ledCancel(g_led_orange);
-                    ledCancel (g_led_red);
-                    return CURRENT_STATE;
-                }
-                case TIMEOUT:
-                {
-                    return OP_TX_AND_WAIT_RESULT;
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-     
-        case ST_TEST_DOOR:
-        {
-            switch(e) 
-            {
-                case ENTER:
-                {
-                    reset_button_tries_error();
-                    reset_button_tries_sent();
-                    ledRequest(g_led_orange, FLASH_4HZ, 30, LED_REQ_INTERUPT);
-                    sm_timer_start(30000);
-                    return CURRENT_STATE;
-                }
-                case TIMEOUT: 
-                {
-                    return ST_TX_AND_WAIT_RESULT;
-                }
-                case EXIT: 
-                {
-                    ledCancel(g_led_orange);
-                    ledCancel(g_led_red);
-                    sm_timer_stop();
-                    return CURRENT_STATE;
-                }
-                case IRQ_HALL: 
-                {
-                    // check hall input and set led appropriately
-                    // TODO
-                    if (GPIO_read(g_hall_pin)==0)
-                    {
-                        ledCancel(g_led_red);
-                        console_printf("Cage opened !! \r\n");
-                    }
-                    else if (GPIO_read(g_hall_pin)==1)
-                    {
-                        ledRequest(g_led_red, ON, 30, LED_REQ_INTERUPT);
-                        console_printf("Cage closed !! \r\n");
-                    }
-                    return CURRENT_STATE;
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case ST_TX_AND_WAIT_RESULT:
-        {
-            switch(e) 
-            {
-                case ENTER: 
-                {
-                    // timeout for lora send
-                    ledCancel(g_led_orange);
-                    ledCancel(g_led_red);
-                    sm_timer_start(20000);
-                    payload[1] = 0x0000;
-                    payload[2]=BoardBatteryMeasureVolage();
-                    console_printf("level battery = %d mV \r\n",payload[2]);
-                    if (lora_app_tx(payload, sizeof(payload), 10000)==LORA_TX_OK) {
-                        return CURRENT_STATE;
-                    }
-                    return ST_SIGNAL_ERROR;
-                }
-                case EXIT: 
-                {
-                    sm_timer_stop();
-                    return CURRENT_STATE;
-                }
-                case TIMEOUT: {
-                    return ST_SIGNAL_TIMEOUT;
-                }
-                case LORA_TX_STATUS:
-                {
-                    // deal with it
-                    LORA_TX_RESULT_t result = (LORA_TX_RESULT_t)data;
-                    if (result==LORA_TX_OK_ACKD) 
-                    {
-                        return ST_SIGNAL_OK;
-                    } 
-                    else if (result==LORA_TX_TIMEOUT) 
-                    {
-                        return ST_SIGNAL_TIMEOUT;
-                    }  
-                    else 
-                    {
-                        return ST_SIGNAL_ERROR;
-                    }
-                    return CURRENT_STATE;
-                } 
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case ST_SIGNAL_TIMEOUT:
-        {
-            switch(e) 
-            {
-                case ENTER :
-                {
-                    ledRequest(g_led_orange, FLASH_1HZ, 5, LED_REQ_INTERUPT);
-                    sm_timer_start(5000);
-                    console_printf("Message sent but not receive \r\n");
-                    console_printf("attempts = %x \r\n", get_button_tries_sent());
-                    return CURRENT_STATE;                          
-                } 
-
-                case TIMEOUT : 
-                {
-                    if (inc_button_tries_sent()>5) {
-                        return ST_RETRY_SENT;
-                    }
-                    return ST_TX_AND_WAIT_RESULT;
-                }
-
-                case EXIT : 
-                {
-                    ledCancel(g_led_red);
-                    ledCancel(g_led_orange);
-                    sm_timer_stop();
-                    return CURRENT_STATE;
-                }
-
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
+/*
+ * Record a door change (and the battery under load) for the next uplink, which waits for the end of the
+ * aggregation window so a burst of moves goes in one frame. Returns true if it should go now (frame full).
+ */
+static bool sm_door_changed(int level) 
+{
+    if (get_current_data()==level) 
+    {
+        return false;
+    }
+    set_current_data(level);
+    // door open (hall==0) is recorded as 1, and journaled until the network has it
+    int door = (level==0)?1:0;
+    bool full = aggreg_add(PL_REC_DOOR, door, sm_journal_add(door));
+    full = aggreg_add(PL_REC_BATTERY, sm_read_battery(), 0) || full;
+    uint32_t window = sm_cfg_get(APPCFG_AGG_WINDOW_MS);
+    if (full || window==0) 
+    {
+        return true;
+    }
+    if (!smtimer_running(SMT_AGGREGATE)) 
+    {
+        sm_timer_start(SMT_AGGREGATE, window);
+    }
+    return false;
+}
 
-        case ST_RETRY_SENT:
-        {
-            switch (e)
-            {
-                case ENTER : 
-                {
-                    sm_timer_start(5000);
-                    ledCancel(g_led_orange);
-                    ledRequest(g_led_red, FLASH_4HZ, 5, LED_REQ_INTERUPT);
-                    console_printf("Message failed, prototype reboot\r\n");    
-                    return CURRENT_STATE;
-                }
-                
-                case TIMEOUT :
-                {        
-                    os_reboot(0);
-                }
-
-                case EXIT : 
-                {
-                    ledCancel(g_led_orange);
-                    ledCancel(g_led_red);
-                    sm_timer_stop();
-                    return CURRENT_STATE;
-                }
-
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }                
-            }
-            return CURRENT_STATE;
-        }
-        case ST_SIGNAL_OK:
-        {
-            switch(e) 
-            {
-                case ENTER : 
-                {
-                    ledRequest(g_led_orange, ON, 10, LED_REQ_INTERUPT);
-                    sm_timer_start(10000);
-                    console_printf("Message sent correctly \r\n");
-                    return CURRENT_STATE;                
-                }
-                case TIMEOUT : 
-                {
-                    return OP_WAITING;
-                }
-                case EXIT : 
-                {
-                    sm_timer_stop();
-                    ledCancel(g_led_orange);
-                    ledCancel (g_led_red);
-                    return CURRENT_STATE;
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
-        case ST_SIGNAL_ERROR:
-        {
-            switch(e) 
-            {
-                case ENTER :
-                {
-                    ledRequest(g_led_red, FLASH_05HZ, 10, LED_REQ_INTERUPT);
-                    sm_timer_start(10000);
-                    console_printf("Message sent error \r\n");
-                    console_printf("attempts = %x \r\n", get_button_tries_error());
-                    return CURRENT_STATE;                          
-                } 
-                case TIMEOUT : 
-                {
-                    if (inc_button_tries_error()>5) {
-                        return ST_TRIES_ERROR;
-                    }
-                    return ST_TX_AND_WAIT_RESULT;
-                }
-                case EXIT : 
-                {
-                    ledCancel(g_led_red);
-                    ledCancel(g_led_orange);
-                    sm_timer_stop();
-                    return CURRENT_STATE;
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            }
-            return CURRENT_STATE;
-        }
+// Super states
+static STATE op_hall(void* data)
+{
+    int level = door_leds(true, (int)(uintptr_t)data);
+    if (sm_door_changed(level)) 
+    {
+        // OP_WAITING will send it
+        _txPending = true;
+    }
+    return CURRENT_STATE;
+}
+static STATE st_hall(void* data)
+{
+    door_leds(false, (int)(uintptr_t)data);
+    return CURRENT_STATE;
+}
+// Parameters changed by a downlink (mask in data) : the others are read when used
+static STATE cfg_changed(void* data)
+{
+    // the new values are in already
+    uint32_t changed = (uint32_t)(uintptr_t)data;
+    if ((changed & APPCFG_BIT(APPCFG_HEARTBEAT_MS)) && smtimer_running(SMT_HEARTBEAT)) 
+    {
+        sm_timer_periodic(SMT_HEARTBEAT, sm_cfg_get(APPCFG_HEARTBEAT_MS));
+    }
+    return CURRENT_STATE;
+}
+static STATE tx_pending(void* data)
+{
+    // don't break off what we are doing, OP_WAITING will send it
+    _txPending = true;
+    return CURRENT_STATE;
+}
+// Heartbeat tick : true if the keepalive wants an uplink now
+static bool sm_heartbeat_due(void) 
+{
+    uint8_t ka = keepalive_tick();
+    if (ka==KEEPALIVE_CHECK) 
+    {
+        _hbCheck = true;
+    }
+    return (ka!=KEEPALIVE_SKIP);
+}
+static STATE hb_pending(void* data)
+{
+    if (sm_heartbeat_due()) 
+    {
+        _txPending = true;
+    }
+    return CURRENT_STATE;
+}
 
-        case ST_TRIES_ERROR :
-        {
-            switch (e)
-            {
-                case ENTER : 
-                {
-                    ledRequest(g_led_red, ON, 30, LED_REQ_INTERUPT);
-                    sm_timer_start(30000);        
-                    console_printf("Message error, prototype reboot\r\n");
-                    return CURRENT_STATE;
-                }            
-                case TIMEOUT :
-                {
-                    return FATAL_ERROR;                    
-                }
-                case EXIT : 
-                {
-                    ledCancel(g_led_orange);
-                    ledCancel(g_led_red);
-                    return CURRENT_STATE;
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-            return CURRENT_STATE;
-            }
-        }
- 
-        case FATAL_ERROR :
+// JOINING : each attempt is at the time given by the join scheduler
+static STATE joining_enter(void* data)
+{
+    sm_timer_start(SMT_RETRY, joinsched_next_ms());
+    ledRequest(g_led_red, FLASH_4HZ, 0, LED_REQ_INTERUPT);
+    return CURRENT_STATE;
+}
+static STATE joining_send(void* data)
+{
+    // send LoRa message (door not known yet, not reported), the stack joins first
+    console_printf("JOIN attempt\r\n");
+    sm_build_frame(PL_REASON_JOIN, 0);
+    sm_lora_tx(LORA_MSG_JOIN);
+    sm_timer_start(SMT_RETRY, joinsched_next_ms());
+    return CURRENT_STATE;
+}
+static STATE joining_exit(void* data)
+{
+    smtimer_stop(SMT_RETRY);
+    return CURRENT_STATE;
+}
+static STATE joining_txstatus(void* data)
+{
+    // status in data : an ack for any of the join attempts means we are in, so no frame check
+    LORA_TX_RESULT_t result = (LORA_TX_RESULT_t)((uintptr_t)data & 0xff);
+    if (result==LORA_TX_OK_ACKD) 
+    {
+        console_printf("JOIN/SEND/RX ok, starting\r\n");
+        joinsched_joined();
+        return STARTING;
+    } 
+    else if (result==LORA_TX_ERR_FATAL) 
+    {
+        console_printf("All bad, reboot\r\n");
+        return FATAL_ERROR;
+    }
+    // else the timer will retry in a bit
+    return CURRENT_STATE;
+}
+
+// STARTING
+static STATE starting_enter(void* data)
+{
+    // init stuff
+    init_tasks();
+    // the heartbeat keeps its cadence whatever the transitions in between
+    sm_timer_periodic(SMT_HEARTBEAT, sm_cfg_get(APPCFG_HEARTBEAT_MS));
+    return OP_WAITING;
+}
+
+// OP_WAITING
+static STATE opwaiting_enter(void* data)
+{
+    if (_txPending) 
+    {
+        return OP_TX_AND_WAIT_RESULT;
+    }
+    return CURRENT_STATE;
+}
+// end of the aggregation window
+static STATE opwaiting_send(void* data)
+{
+    return OP_TX_AND_WAIT_RESULT;
+}
+static STATE opwaiting_heartbeat(void* data)
+{
+    if (sm_heartbeat_due()) 
+    {
+        return OP_TX_AND_WAIT_RESULT;
+    }
+    // skipped : nothing new, and the link was acked not long ago
+    return CURRENT_STATE;
+}
+static STATE opwaiting_button(void* data)
+{
+    return ST_TEST_DOOR;
+}
+static STATE opwaiting_hall(void* data)
+{
+    // door LEDs as in any OP state, and signal the change if it is one
+    int level = door_leds(true, (int)(uintptr_t)data);
+    if (sm_door_changed(level)) 
+    {
+        return OP_TX_AND_WAIT_RESULT;
+    }
+    return CURRENT_STATE;
+}
+
+// OP_TX_AND_WAIT_RESULT
+static STATE optx_enter(void* data)
+{
+    // any uplink does for the heartbeat, and takes all the records so far
+    _txPending = false;
+    smtimer_stop(SMT_AGGREGATE);
+    uint8_t reason = (aggreg_count()>0)?PL_REASON_DOOR:PL_REASON_HEARTBEAT;
+    // door open (hall==0) is signalled as 1
+    sm_build_frame(reason, (sm_read_hall()==0)?1:0);
+    // in redundant history mode the next uplinks carry the change again, instead of an ack
+    LORA_MSG_CLASS_t doorCls = (sm_cfg_get(APPCFG_HISTORY_EVENTS)>0)?LORA_MSG_EVENT:LORA_MSG_ALARM;
+    LORA_MSG_CLASS_t hbCls = _hbCheck?LORA_MSG_LINKCHECK:LORA_MSG_HEARTBEAT;
+    _hbCheck = false;
+    if (sm_lora_tx((reason==PL_REASON_DOOR)?doorCls:hbCls)==LORA_TX_OK) {
+        return CURRENT_STATE;
+    }
+    return OP_SIGNAL_ERROR;
+}
+static STATE optx_timeout(void* data)
+{
+    // no answer
+    return OP_SIGNAL_TIMEOUT;
+}
+static STATE optx_txstatus(void* data)
+{
+    // status in data
+    LORA_TX_RESULT_t result;
+    if (!sm_tx_result(data, &result)) 
+    {
+        return CURRENT_STATE;
+    }
+    // an unconfirmed heartbeat is done once sent, door changes wait for their ack (but in redundant history mode)
+    if (result==LORA_TX_OK_ACKD || result==LORA_TX_OK) 
+    {
+        aggreg_sent(_txAggCount);
+        if (result==LORA_TX_OK_ACKD) 
         {
-            switch (e)
-            {
-                case ENTER : 
-                {
-                    os_reboot(0);                    
-                }
-                default: {
-                    console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-                    return CURRENT_STATE;
-                }
-
-            return CURRENT_STATE;
-            }
+            sm_journal_acked();
         }
+        keepalive_uplink(_txBatt, (_txReason==PL_REASON_DOOR), (result==LORA_TX_OK_ACKD));
+        return OP_SIGNAL_OK;
+    } 
+    else if (result==LORA_TX_TIMEOUT) 
+    {
+        return OP_SIGNAL_TIMEOUT;
+    }  
+    return OP_SIGNAL_ERROR;
+}
 
-        default: 
-        {
-            console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
-            assert(0);      // STOP NOW
-            return CURRENT_STATE;
-        }        
+// OP_SIGNAL_OK
+static STATE opok_enter(void* data)
+{
+    ledRequest(g_led_orange, ON, sm_cfg_get(APPCFG_LED_CONFIRM_MS)/1000, LED_REQ_INTERUPT);
+    return OP_WAITING;
+}
+
+// OP_SIGNAL_TIMEOUT, OP_SIGNAL_ERROR
+static STATE operror_enter(void* data)
+{
+    ledRequest(g_led_orange, FLASH_4HZ, 10, LED_REQ_INTERUPT);
+    // heartbeats at every tick until the link is seen again
+    keepalive_failed();
+    if (get_current_data()==0) 
+    {
+        // ok too bad : it stays in the aggregator for the next uplink, and in the journal for the backlog
+        return OP_WAITING;
+    }
+    // retry when the retry timer expires
+    return CURRENT_STATE;
+}
+static STATE operror_retry(void* data)
+{
+    return OP_TX_AND_WAIT_RESULT;
+}
+
+// ST_TEST_DOOR
+static STATE sttest_enter(void* data)
+{
+    reset_button_tries_error();
+    reset_button_tries_sent();
+    ledRequest(g_led_orange, FLASH_4HZ, 30, LED_REQ_INTERUPT);
+    return CURRENT_STATE;
+}
+static STATE sttest_timeout(void* data)
+{
+    return ST_TX_AND_WAIT_RESULT;
+}
+
+// ST_TX_AND_WAIT_RESULT
+static STATE sttx_enter(void* data)
+{
+    // timeout for lora send is the state timer
+    ledCancel(g_led_orange);
+    ledCancel(g_led_red);
+    sm_build_frame(PL_REASON_TEST, 0);
+    if (sm_lora_tx(LORA_MSG_TEST)==LORA_TX_OK) {
+        return CURRENT_STATE;
+    }
+    return ST_SIGNAL_ERROR;
+}
+static STATE sttx_timeout(void* data)
+{
+    return ST_SIGNAL_TIMEOUT;
+}
+static STATE sttx_txstatus(void* data)
+{
+    LORA_TX_RESULT_t result;
+    if (!sm_tx_result(data, &result)) 
+    {
+        return CURRENT_STATE;
+    }
+    if (result==LORA_TX_OK_ACKD) 
+    {
+        aggreg_sent(_txAggCount);
+        sm_journal_acked();
+        keepalive_uplink(_txBatt, false, true);
+        return ST_SIGNAL_OK;
+    } 
+    else if (result==LORA_TX_TIMEOUT) 
+    {
+        return ST_SIGNAL_TIMEOUT;
+    }  
+    return ST_SIGNAL_ERROR;
+}
+
+// ST_SIGNAL_TIMEOUT, ST_SIGNAL_ERROR, ST_TRIES_ERROR : parameterised by their sm_signal
+static const struct sm_signal _stSignalTimeout = {
+    .led = SM_LED_ORANGE, .pattern = FLASH_1HZ, .durSecs = 5,
+    .msg = "Message sent but not receive",
+    .getTries = get_button_tries_sent, .incTries = inc_button_tries_sent,
+    .onTooManyTries = ST_RETRY_SENT,
+};
+static const struct sm_signal _stSignalError = {
+    .led = SM_LED_RED, .pattern = FLASH_05HZ, .durSecs = 10,
+    .msg = "Message sent error",
+    .getTries = get_button_tries_error, .incTries = inc_button_tries_error,
+    .onTooManyTries = ST_TRIES_ERROR,
+};
+static const struct sm_signal _stTriesError = {
+    .led = SM_LED_RED, .pattern = ON, .durSecs = 30,
+    .msg = "Message error, prototype reboot",
+    .onTooManyTries = FATAL_ERROR,
+};
+static STATE stsignal_enter(void* data)
+{
+    const struct sm_signal* sig = _smStates[_currentState].signal;
+    ledRequest(sm_led(sig->led), sig->pattern, sig->durSecs, LED_REQ_INTERUPT);
+    console_printf("%s \r\n", sig->msg);
+    if (sig->getTries!=NULL) 
+    {
+        console_printf("attempts = %x \r\n", (*sig->getTries)());
+    }
+    return CURRENT_STATE;
+}
+static STATE stsignal_retry(void* data)
+{
+    const struct sm_signal* sig = _smStates[_currentState].signal;
+    if (sig->incTries==NULL || (*sig->incTries)()>(int)sm_cfg_get(APPCFG_MAX_TRIES)) {
+        return sig->onTooManyTries;
     }
+    return ST_TX_AND_WAIT_RESULT;
+}
+
+// ST_RETRY_SENT
+static STATE stretry_enter(void* data)
+{
+    ledCancel(g_led_orange);
+    ledRequest(g_led_red, FLASH_4HZ, 5, LED_REQ_INTERUPT);
+    console_printf("Message failed, prototype reboot\r\n");    
+    return CURRENT_STATE;
+}
+static STATE reboot_action(void* data)
+{
+#if MYNEWT_VAL(SM_REPLAY)
+    smreplay_finish("reboot");
+#endif
+    // keep the trace and the input capture of what led here
+    smtrace_seal();
+    smcapture_seal();
+    os_reboot(0);
     return CURRENT_STATE;
+}
+
+// ST_SIGNAL_OK
+static STATE stok_enter(void* data)
+{
+    ledRequest(g_led_orange, ON, sm_cfg_get(APPCFG_LED_CONFIRM_MS)/1000, LED_REQ_INTERUPT);
+    console_printf("Message sent correctly \r\n");
+    return CURRENT_STATE;                
+}
+static STATE stok_timeout(void* data)
+{
+    return OP_WAITING;
+}
 
-}
\ No newline at end of file
+/*
+ * The state table : one const descriptor per state, indexed by STATE, lives in flash.
+ * actions[] is indexed by EVENT (NULL means the event is passed to the parent, if any).
+ * timeoutMs (or the timeoutCfg parameter, or with timeoutTx the time the frame just queued may take) is started
+ * on the named timer (the state timer by default) when ENTER leaves us in the state, and that timer is stopped 
+ * on EXIT. The heartbeat belongs to no state.
+ * exitLeds are the LEDs cancelled on EXIT.
+ */
+static const SM_STATE_DESC_t _smStates[SM_NB_DESCS] = 
+{
+    [SM_SUPER_OP] = {
+        .actions = { [IRQ_HALL]=op_hall, [TIMEOUT_HEARTBEAT]=hb_pending, [TIMEOUT_AGG]=tx_pending, [LORA_RX]=cfg_changed },
+    },
+    [SM_SUPER_ST] = {
+        .actions = { [IRQ_HALL]=st_hall, [TIMEOUT_HEARTBEAT]=hb_pending, [TIMEOUT_AGG]=tx_pending, [LORA_RX]=cfg_changed },
+        .exitLeds = SM_LED_ORANGE | SM_LED_RED,
+    },
+    [JOINING] = {
+        .actions = { [ENTER]=joining_enter, [EXIT]=joining_exit, [TIMEOUT_RETRY]=joining_send, [LORA_TX_STATUS]=joining_txstatus },
+        .exitLeds = SM_LED_RED,
+    },
+    [STARTING] = {
+        .actions = { [ENTER]=starting_enter },
+    },
+    [OP_WAITING] = {
+        .actions = { [ENTER]=opwaiting_enter, [TIMEOUT_HEARTBEAT]=opwaiting_heartbeat, [TIMEOUT_AGG]=opwaiting_send, [IRQ_BUTT]=opwaiting_button, [IRQ_HALL]=opwaiting_hall },
+        .parent = SM_SUPER_OP,
+    },
+    [OP_TX_AND_WAIT_RESULT] = {
+        .actions = { [ENTER]=optx_enter, [TIMEOUT]=optx_timeout, [LORA_TX_STATUS]=optx_txstatus },
+        .timeoutTx = true,
+        .parent = SM_SUPER_OP,
+    },
+    [OP_SIGNAL_OK] = {
+        .actions = { [ENTER]=opok_enter },
+        .parent = SM_SUPER_OP,
+    },
+    [OP_SIGNAL_ERROR] = {
+        .actions = { [ENTER]=operror_enter, [TIMEOUT_RETRY]=operror_retry },
+        .timeoutCfg = APPCFG_OP_RETRY_MS,
+        .timer = SMT_RETRY,
+        .parent = SM_SUPER_OP,
+    },
+    [OP_SIGNAL_TIMEOUT] = {
+        .actions = { [ENTER]=operror_enter, [TIMEOUT_RETRY]=operror_retry },
+        .timeoutCfg = APPCFG_OP_RETRY_MS,
+        .timer = SMT_RETRY,
+        .parent = SM_SUPER_OP,
+    },
+    [ST_TEST_DOOR] = {
+        .actions = { [ENTER]=sttest_enter, [TIMEOUT]=sttest_timeout },
+        .timeoutMs = 30000,
+        .parent = SM_SUPER_ST,
+    },
+    [ST_TX_AND_WAIT_RESULT] = {
+        .actions = { [ENTER]=sttx_enter, [TIMEOUT]=sttx_timeout, [LORA_TX_STATUS]=sttx_txstatus },
+        .timeoutTx = true,
+        .parent = SM_SUPER_ST,
+    },
+    [ST_SIGNAL_TIMEOUT] = {
+        .actions = { [ENTER]=stsignal_enter, [TIMEOUT_RETRY]=stsignal_retry },
+        .timeoutCfg = APPCFG_ST_NOACK_RETRY_MS,
+        .timer = SMT_RETRY,
+        .parent = SM_SUPER_ST,
+        .signal = &_stSignalTimeout,
+    },
+    [ST_RETRY_SENT] = {
+        .actions = { [ENTER]=stretry_enter, [TIMEOUT]=reboot_action },
+        .timeoutMs = 5000,
+        .parent = SM_SUPER_ST,
+    },
+    [ST_SIGNAL_OK] = {
+        .actions = { [ENTER]=stok_enter, [TIMEOUT_LED]=stok_timeout },
+        .timeoutCfg = APPCFG_LED_CONFIRM_MS,
+        .timer = SMT_LED_CONFIRM,
+        .parent = SM_SUPER_ST,
+    },
+    [ST_SIGNAL_ERROR] = {
+        .actions = { [ENTER]=stsignal_enter, [TIMEOUT_RETRY]=stsignal_retry },
+        .timeoutCfg = APPCFG_ST_ERROR_RETRY_MS,
+        .timer = SMT_RETRY,
+        .parent = SM_SUPER_ST,
+        .signal = &_stSignalError,
+    },
+    [ST_TRIES_ERROR] = {
+        .actions = { [ENTER]=stsignal_enter, [TIMEOUT_RETRY]=stsignal_retry },
+        .timeoutMs = 30000,
+        .timer = SMT_RETRY,
+        .parent = SM_SUPER_ST,
+        .signal = &_stTriesError,
+    },
+    [FATAL_ERROR] = {
+        .actions = { [ENTER]=reboot_action },
+    },
+};
+
+static uint32_t sm_desc_timeout(const SM_STATE_DESC_t* sd) 
+{
+    if (sd->timeoutTx) 
+    {
+        return _txTimeoutMs;
+    }
+    return (sd->timeoutCfg!=APPCFG_NONE)?sm_cfg_get(sd->timeoutCfg):sd->timeoutMs;
+}
+
+static void sm_exit_desc(const SM_STATE_DESC_t* sd) 
+{
+    if (sd->timeoutMs>0 || sd->timeoutCfg!=APPCFG_NONE || sd->timeoutTx) 
+    {
+        smtimer_stop(sd->timer);
+    }
+    if (sd->exitLeds & SM_LED_ORANGE) 
+    {
+        ledCancel(g_led_orange);
+    }
+    if (sd->exitLeds & SM_LED_RED) 
+    {
+        ledCancel(g_led_red);
+    }
+    if (sd->actions[EXIT]!=NULL) 
+    {
+        (*sd->actions[EXIT])(NULL);
+    }
+}
+
+// Run the EXIT of the current state, and of its parent if next is outside the group
+static void sm_exit(STATE next) 
+{
+    assert(_currentState<SM_NB_STATES);
+    uint8_t parent = _smStates[_currentState].parent;
+    sm_exit_desc(&_smStates[_currentState]);
+    if (parent!=SM_NO_PARENT && parent!=_smStates[next].parent) 
+    {
+        sm_exit_desc(&_smStates[parent]);
+    }
+}
+
+// Run the ENTER of the parent if we came from outside the group, then of the new state
+static STATE sm_enter(STATE prev) 
+{
+    assert(_currentState<SM_NB_STATES);
+    const SM_STATE_DESC_t* sd = &_smStates[_currentState];
+    if (sd->parent!=SM_NO_PARENT && sd->parent!=_smStates[prev].parent && _smStates[sd->parent].actions[ENTER]!=NULL) 
+    {
+        (*_smStates[sd->parent].actions[ENTER])(NULL);
+    }
+    // a state with no ENTER action still gets its timer
+    STATE next = (sd->actions[ENTER]!=NULL)?(*sd->actions[ENTER])(NULL):CURRENT_STATE;
+    uint32_t timeoutMs = sm_desc_timeout(sd);
+    if (next==CURRENT_STATE && timeoutMs>0) 
+    {
+        sm_timer_start(sd->timer, timeoutMs);
+    }
+    return next;
+}
+
+// Dispatch any other event to the current state, or its parent if it does not process it
+static STATE statemachine(EVENT e, void* data) 
+{
+    assert(_currentState<SM_NB_STATES);
+    assert(e<SM_NB_EVENTS && e!=ENTER && e!=EXIT);
+    uint8_t s = _currentState;
+    while (s!=SM_NO_PARENT) 
+    {
+        if (_smStates[s].actions[e]!=NULL) 
+        {
+            return (*_smStates[s].actions[e])(data);
+        }
+        s = _smStates[s].parent;
+    }
+    if (_currentState!=NOTINIT) 
+    {
+        console_printf("in state %d got unprocessed event %d \r\n", _currentState, e);
+    }
+    return CURRENT_STATE;
+}
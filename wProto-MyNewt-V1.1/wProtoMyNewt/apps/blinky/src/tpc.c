@@ -0,0 +1,66 @@
+/**
+ Wyres private code
+ Transmit power control from the downlink link margin.
+ */
+
+#include "os/os.h"
+
+#include "tpc.h"
+
+#define TPC_MARGIN_DB           MYNEWT_VAL(LORA_TPC_MARGIN_DB)
+#define TPC_STEP_AFTER          MYNEWT_VAL(LORA_TPC_STEP_AFTER)
+#define TPC_MIN_DBM             MYNEWT_VAL(LORA_TPC_MIN_DBM)
+
+// Lowest SNR (dB) the SX1272 demodulates at each DR (SF12 -20 ... SF7 -7.5, rounded up)
+static const int8_t _snrFloorByDR[] = { -20, -17, -15, -12, -10, -7, -7, -7 };
+
+static struct {
+    int8_t maxDbm;
+    int8_t dBm;             // tx power in use
+    uint8_t goodRun;        // margins high enough to step down, in a row
+} _tpc;
+
+void tpc_init(int8_t maxDbm) {
+    _tpc.maxDbm = maxDbm;
+    _tpc.dBm = maxDbm;
+    _tpc.goodRun = 0;
+}
+
+int8_t tpc_dbm(void) {
+    return _tpc.dBm;
+}
+
+void tpc_set(int8_t dBm) {
+    _tpc.dBm = dBm;
+}
+
+// A change of power is asked for : a new run of margins starts
+static int8_t tpc_want(int dBm) {
+    if (dBm>_tpc.maxDbm) {
+        dBm = _tpc.maxDbm;
+    }
+    if (dBm<TPC_MIN_DBM) {
+        dBm = TPC_MIN_DBM;
+    }
+    _tpc.goodRun = 0;
+    return dBm;
+}
+
+int8_t tpc_margin(int8_t snr, uint8_t dr) {
+    int margin = snr - _snrFloorByDR[(dr<sizeof(_snrFloorByDR))?dr:0];
+    if (margin<TPC_MARGIN_DB) {
+        return tpc_want(_tpc.dBm+2);
+    }
+    if (margin>=(TPC_MARGIN_DB+2) && _tpc.dBm>TPC_MIN_DBM) {
+        if (++_tpc.goodRun>=TPC_STEP_AFTER) {
+            return tpc_want(_tpc.dBm-2);
+        }
+    } else {
+        _tpc.goodRun = 0;
+    }
+    return _tpc.dBm;
+}
+
+int8_t tpc_missed(bool lost) {
+    return tpc_want(lost?_tpc.maxDbm:(_tpc.dBm+2));
+}
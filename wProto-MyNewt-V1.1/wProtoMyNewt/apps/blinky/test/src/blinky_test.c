@@ -0,0 +1,58 @@
+/**
+ Wyres private code
+ Unit tests and host simulations of the app modules.
+ */
+
+#include "sysinit/sysinit.h"
+#include "testutil/testutil.h"
+
+// the modules read the simulated clock
+#define os_get_uptime_usec  blinky_test_uptime_usec
+
+#include "../../src/airtime.c"
+#include "../../src/joinsched.c"
+#include "../../src/tpc.c"
+#include "../../src/payload.c"
+#include "../../src/keepalive.c"
+
+#include "blinky_test.h"
+
+int64_t blinky_test_now_us = 0;
+
+#define APPCFG_PARAM(n, k, id, mn, mx, def) [APPCFG_##n] = (def),
+uint32_t blinky_test_cfg[APPCFG_NB] = {
+    APPCFG_PARAMS
+};
+#undef APPCFG_PARAM
+
+// the parameters as the state machine gives them to its modules (appcfg.c needs sys/config)
+uint32_t sm_cfg_get(uint8_t p) {
+    return blinky_test_cfg[p];
+}
+
+int64_t blinky_test_uptime_usec(void) {
+    return blinky_test_now_us;
+}
+
+uint32_t blinky_test_rand(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+TEST_SUITE(blinky_test_all) {
+    airtime_init();
+    join_collide_test();
+    tpc_step_test();
+    history_model_test();
+    keepalive_run_test();
+}
+
+#if MYNEWT_VAL(SELFTEST)
+int main(int argc, char** argv) {
+    sysinit();
+    blinky_test_all();
+    return tu_any_failed;
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef H_BLINKY_TEST_H
+#define H_BLINKY_TEST_H
+
+#include <inttypes.h>
+#include "testutil/testutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ The app modules under test are built in blinky_test.c from the app sources, reading this clock instead of the
+ os uptime, so a simulation can run days in no time.
+ */
+extern int64_t blinky_test_now_us;
+// The application parameters appcfg_get() gives them, at their defaults until a test changes them
+extern uint32_t blinky_test_cfg[];
+
+// xorshift32 : the same draws on any host, so the figures printed are the ones quoted
+uint32_t blinky_test_rand(uint32_t* state);
+
+TEST_CASE_DECL(join_collide_test)
+TEST_CASE_DECL(tpc_step_test)
+TEST_CASE_DECL(history_model_test)
+TEST_CASE_DECL(keepalive_run_test)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* H_BLINKY_TEST_H */
@@ -0,0 +1,177 @@
+/**
+ Wyres private code
+ Door events sent confirmed vs repeated in the history of every uplink : airtime, energy and delivery over a
+ simulated year. Frame sizes come from the payload encoder, times on air from airtime.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "airtime.h"
+#include "payload.h"
+#include "blinky_test.h"
+
+#define HM_TX_MA            (30.0)
+#define HM_RX_MA            (11.0)
+#define HM_RX_EMPTY_MS      (1000.0)        // an rx window that gets nothing (SX127X_RADIO_MIN_RX_DURATION)
+#define HM_NB_TRIALS        (2)             // LORAWAN_API_DEFAULT_NB_TRIALS
+#define HM_EV_PER_DAY       (20.0)
+#define HM_DAYS             (365)
+#define HM_MAX_PENDING      (PL_MAX_RECORDS)
+
+typedef struct {
+    uint32_t rnd;
+    double loss;
+    uint8_t dr;
+    double toaMs;
+    double mC;
+    long uplinks;
+} HM_LINK_t;
+
+typedef struct {
+    long events;
+    long lost;              // never got to the network
+    long late;              // got there in a later uplink than their own
+    double upPerDay;
+    double airtimeSPerDay;
+    double mAhPerDay;
+} HM_RESULT_t;
+
+static double hm_uniform(uint32_t* rnd) {
+    return ((blinky_test_rand(rnd)>>8)+1)/16777217.0;
+}
+
+// One uplink (with its retries if confirmed) : did the network get it, and was it acked
+static bool hm_uplink(HM_LINK_t* l, uint8_t sz, bool confirmed, bool* acked) {
+    bool got = false;
+    *acked = false;
+    for(int t=0;t<(confirmed?HM_NB_TRIALS:1) && !*acked;t++) {
+        double toa = airtime_toa_ms(l->dr, sz);
+        l->toaMs += toa;
+        l->mC += toa*HM_TX_MA/1000;
+        l->uplinks++;
+        bool in = (hm_uniform(&l->rnd)>=l->loss);
+        got = got || in;
+        if (confirmed && in && hm_uniform(&l->rnd)>=l->loss) {
+            *acked = true;
+            l->mC += airtime_toa_ms(l->dr, 0)*HM_RX_MA/1000;
+        } else {
+            // rx1 and rx2 open for nothing
+            l->mC += 2*HM_RX_EMPTY_MS*HM_RX_MA/1000;
+        }
+    }
+    return got;
+}
+
+// The status frame : door records for the pending events, or the last k events as history
+static uint8_t hm_frame_sz(uint8_t reason, int nrecs, const double* histAt, int nhist, double now) {
+    PAYLOAD_t p;
+    payload_init(&p);
+    payload_set(&p, PL_REASON, reason);
+    payload_set(&p, PL_DOOR, 0);
+    payload_set(&p, PL_BATTERY, 3000);
+    for(int i=0;i<nrecs;i++) {
+        payload_add_record(&p, PL_REC_DOOR, 60, i&1);
+    }
+    for(int i=0;i<nhist;i++) {
+        payload_add_history(&p, 100+i, i&1, (uint32_t)(now-histAt[i]));
+    }
+    return payload_size(&p);
+}
+
+static void hm_run(uint8_t dr, double loss, int k, uint32_t hbS, HM_RESULT_t* res) {
+    HM_LINK_t l = { .rnd = 7, .loss = loss, .dr = dr };
+    double at[HM_MAX_PENDING];      // events not known delivered, or the history when k>0, oldest first
+    bool ok[HM_MAX_PENDING];
+    int np = 0;
+    double t = 0;
+    double nextHb = hbS;
+    double nextEv = -log(hm_uniform(&l.rnd))*86400.0/HM_EV_PER_DAY;
+    res->events = res->lost = res->late = 0;
+    while (t<HM_DAYS*86400.0) {
+        bool isEv = (nextEv<nextHb);
+        t = isEv?nextEv:nextHb;
+        if (isEv) {
+            res->events++;
+            nextEv = t-log(hm_uniform(&l.rnd))*86400.0/HM_EV_PER_DAY;
+            if (np==((k>0)?k:HM_MAX_PENDING)) {
+                // out of the history (or of the aggregator)
+                res->lost += ok[0]?0:1;
+                for(int i=1;i<np;i++) {
+                    at[i-1] = at[i];
+                    ok[i-1] = ok[i];
+                }
+                np--;
+            }
+            at[np] = t;
+            ok[np] = false;
+            np++;
+        } else {
+            nextHb += hbS;
+        }
+        bool acked;
+        bool got;
+        if (k==0) {
+            // the pending events go in a confirmed door frame, else an unconfirmed heartbeat
+            int n = 0;
+            for(int i=0;i<np;i++) {
+                n += ok[i]?0:1;
+            }
+            got = hm_uplink(&l, hm_frame_sz((n>0)?PL_REASON_DOOR:PL_REASON_HEARTBEAT, n, NULL, 0, t), (n>0), &acked);
+            if (acked || n==0) {
+                // acked : out of the aggregator
+                np = 0;
+            }
+        } else {
+            got = hm_uplink(&l, hm_frame_sz(isEv?PL_REASON_DOOR:PL_REASON_HEARTBEAT, isEv?1:0, at, np, t), false, &acked);
+        }
+        if (got) {
+            for(int i=0;i<np;i++) {
+                if (!ok[i]) {
+                    ok[i] = true;
+                    res->late += (at[i]<t)?1:0;
+                }
+            }
+        }
+    }
+    res->upPerDay = l.uplinks/(double)HM_DAYS;
+    res->airtimeSPerDay = l.toaMs/1000/HM_DAYS;
+    res->mAhPerDay = l.mC/3600/HM_DAYS;
+}
+
+TEST_CASE(history_model_test) {
+    static const struct {
+        uint8_t dr;
+        double loss;
+        uint32_t hbS;
+    } cases[] = {
+        { 0, 0.1, 300 },
+        { 0, 0.3, 300 },
+        { 5, 0.3, 300 },
+        { 0, 0.3, 3600 },
+    };
+    for(int c=0;c<sizeof(cases)/sizeof(cases[0]);c++) {
+        HM_RESULT_t conf;
+        HM_RESULT_t hist;
+        hm_run(cases[c].dr, cases[c].loss, 0, cases[c].hbS, &conf);
+        hm_run(cases[c].dr, cases[c].loss, 3, cases[c].hbS, &hist);
+        for(int v=0;v<2;v++) {
+            HM_RESULT_t* r = v?&hist:&conf;
+            printf("history DR%d loss %2.0f%% hb %4lus %-9s : %5.1f up/day, %6.1f s/day airtime, %.3f mAh/day, lost %ld/%ld, late %ld\n",
+                cases[c].dr, cases[c].loss*100, (unsigned long)cases[c].hbS, v?"K=3":"confirmed",
+                r->upPerDay, r->airtimeSPerDay, r->mAhPerDay, r->lost, r->events, r->late);
+        }
+        TEST_ASSERT(conf.lost==0);
+        if (cases[c].hbS==300) {
+            // the history on every heartbeat makes it dearer than the acks
+            TEST_ASSERT(hist.airtimeSPerDay>conf.airtimeSPerDay);
+            TEST_ASSERT(hist.mAhPerDay>conf.mAhPerDay);
+            TEST_ASSERT(hist.lost==0);
+        } else {
+            // not with hourly heartbeats
+            TEST_ASSERT(hist.airtimeSPerDay<conf.airtimeSPerDay);
+            TEST_ASSERT(hist.mAhPerDay<conf.mAhPerDay);
+        }
+    }
+}
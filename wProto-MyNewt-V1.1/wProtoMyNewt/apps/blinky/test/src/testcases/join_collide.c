@@ -0,0 +1,161 @@
+/**
+ Wyres private code
+ Join requests of nodes powered up together (site power cut) : how many collide, how long till all joined.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "airtime.h"
+#include "joinsched.h"
+#include "blinky_test.h"
+
+#define JC_MAX_NODES        (100)
+#define JC_MAX_ATTEMPTS     (300)           // over the horizon : 288 with the old 300 s period
+#define JC_HORIZON_US       (24*3600*1000000LL)
+#define JC_BOOT_JITTER_MS   (200)           // the nodes power up within this of each other
+#define JC_CHANNELS         (3)             // EU868 join channels, picked at random
+#define JC_RUNS             (30)
+
+typedef struct {
+    int64_t startUs;
+    int64_t endUs;
+    uint8_t node;
+    uint8_t ch;
+    bool sent;
+    bool ok;
+} JC_TX_t;
+
+static JC_TX_t _jcTx[JC_MAX_NODES*JC_MAX_ATTEMPTS];
+static bool _jcJoined[JC_MAX_NODES];
+
+static int jc_tx_cmp(const void* a, const void* b) {
+    int64_t d = ((const JC_TX_t*)a)->startUs - ((const JC_TX_t*)b)->startUs;
+    return (d<0)?-1:((d>0)?1:0);
+}
+
+// The attempts of a node if it never gets through : they only depend on its own schedule
+static int jc_node_attempts(int node, bool sched, uint32_t seed, int64_t bootUs, uint32_t* rnd, JC_TX_t* tx) {
+    int64_t at = bootUs;
+    int n = 0;
+    if (sched) {
+        blinky_test_now_us = bootUs;
+        joinsched_init(seed);
+        at += (int64_t)joinsched_next_ms()*1000;
+    }
+    while (at<JC_HORIZON_US && n<JC_MAX_ATTEMPTS) {
+        tx[n].startUs = at;
+        tx[n].endUs = at + (int64_t)airtime_join_toa_ms(0)*1000;
+        tx[n].node = node;
+        tx[n].ch = blinky_test_rand(rnd) % JC_CHANNELS;
+        tx[n].sent = false;
+        tx[n].ok = false;
+        n++;
+        if (sched) {
+            blinky_test_now_us = at;
+            at += (int64_t)joinsched_next_ms()*1000;
+        } else {
+            // the scheme it replaced : at once, 20 s later, then every 300 s
+            at += (n==1)?20000000LL:300000000LL;
+        }
+    }
+    return n;
+}
+
+// A sent request gets through if no other sent one overlaps it on its channel (ALOHA, no capture)
+static void jc_resolve(int i, int ntx) {
+    JC_TX_t* a = &_jcTx[i];
+    a->ok = true;
+    for(int j=i-1;j>=0 && _jcTx[j].startUs>(a->startUs-(a->endUs-a->startUs));j--) {
+        if (_jcTx[j].sent && _jcTx[j].ch==a->ch && _jcTx[j].endUs>a->startUs) {
+            a->ok = false;
+        }
+    }
+    for(int j=i+1;j<ntx && _jcTx[j].startUs<a->endUs;j++) {
+        if (_jcTx[j].sent && _jcTx[j].ch==a->ch) {
+            a->ok = false;
+        }
+    }
+    if (a->ok) {
+        _jcJoined[a->node] = true;
+    }
+}
+
+typedef struct {
+    int sent;
+    int collided;
+    int allJoinedRuns;
+    double allJoinedS;      // summed over the runs where all joined
+} JC_RESULT_t;
+
+static void jc_run(int nodes, bool sched, JC_RESULT_t* res) {
+    uint32_t rnd = 1234;
+    for(int r=0;r<JC_RUNS;r++) {
+        int ntx = 0;
+        for(int i=0;i<nodes;i++) {
+            int64_t bootUs = (int64_t)(blinky_test_rand(&rnd) % JC_BOOT_JITTER_MS)*1000;
+            // as the app seeds it from its DevEUI : differs between nodes
+            uint32_t seed = ((uint32_t)(0x1000 + i*7919 + r*104729)<<16) ^ (uint32_t)bootUs;
+            ntx += jc_node_attempts(i, sched, seed, bootUs, &rnd, &_jcTx[ntx]);
+            _jcJoined[i] = false;
+        }
+        qsort(_jcTx, ntx, sizeof(_jcTx[0]), jc_tx_cmp);
+        // in time order : the requests that ended before this one started are decided, so we know if it is sent
+        int resolved = 0;
+        int64_t lastJoinUs = 0;
+        for(int i=0;i<=ntx;i++) {
+            int64_t now = (i<ntx)?_jcTx[i].startUs:INT64_MAX;
+            for(;resolved<i && _jcTx[resolved].endUs<=now;resolved++) {
+                if (_jcTx[resolved].sent) {
+                    jc_resolve(resolved, ntx);
+                    res->sent++;
+                    res->collided += _jcTx[resolved].ok?0:1;
+                    if (_jcTx[resolved].ok && _jcTx[resolved].endUs>lastJoinUs) {
+                        lastJoinUs = _jcTx[resolved].endUs;
+                    }
+                }
+            }
+            if (i<ntx) {
+                _jcTx[i].sent = !_jcJoined[_jcTx[i].node];
+            }
+        }
+        int joined = 0;
+        for(int i=0;i<nodes;i++) {
+            joined += _jcJoined[i]?1:0;
+        }
+        if (joined==nodes) {
+            res->allJoinedRuns++;
+            res->allJoinedS += lastJoinUs/1e6;
+        }
+    }
+}
+
+TEST_CASE(join_collide_test) {
+    // collisions at most with joinsched : the figures measured, plus 2 for a change of seed
+    static const struct {
+        int nodes;
+        int maxCollidedPct;
+    } cases[] = {
+        { 20, 17 },
+        { 50, 33 },
+        { 100, 49 },
+    };
+    for(int c=0;c<sizeof(cases)/sizeof(cases[0]);c++) {
+        for(int sched=0;sched<2;sched++) {
+            JC_RESULT_t res = { 0 };
+            jc_run(cases[c].nodes, sched, &res);
+            int pct = (100*res.collided)/((res.sent>0)?res.sent:1);
+            printf("join %3d nodes, %s : %2d%% of %5d requests/run collide, all joined in %2d/%d runs",
+                cases[c].nodes, sched?"joinsched":"old     ", pct, res.sent/JC_RUNS, res.allJoinedRuns, JC_RUNS);
+            if (res.allJoinedRuns>0) {
+                printf(" (in %.0f s)", res.allJoinedS/res.allJoinedRuns);
+            }
+            printf("\n");
+            if (sched) {
+                TEST_ASSERT(res.allJoinedRuns==JC_RUNS);
+                TEST_ASSERT(pct<=cases[c].maxCollidedPct);
+            }
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ Wyres private code
+ Keepalive over a month of heartbeat ticks : how many status uplinks go, and the longest time without one.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "appcfg.h"
+#include "keepalive.h"
+#include "blinky_test.h"
+
+#define KR_DAYS             (30)
+#define KR_DRAIN_MV_TICK    (0.01)          // 3 mV a day at 5 min ticks
+
+static double kr_uniform(uint32_t* rnd) {
+    return ((blinky_test_rand(rnd)>>8)+1)/16777217.0;
+}
+
+// Exponential time (in ticks) to the next door change
+static double kr_next_door(uint32_t* rnd, double ticksPerDay, int perDay) {
+    return -log(kr_uniform(rnd))*ticksPerDay/perDay;
+}
+
+TEST_CASE(keepalive_run_test) {
+    static const struct {
+        int doorsPerDay;
+        int lossPct;
+        long hb;                // heartbeats sent over the KR_DAYS, as quoted for the keepalive (per day)
+    } cases[] = {
+        { 0, 0, 736 },          // 24.5
+        { 0, 30, 988 },         // 32.9
+        { 20, 0, 1860 },        // 62.0
+        { 20, 30, 1876 },       // 62.5
+    };
+    uint32_t hbMs = blinky_test_cfg[APPCFG_HEARTBEAT_MS];
+    double ticksPerDay = 86400000.0/hbMs;
+    uint32_t maxGapTicks = blinky_test_cfg[APPCFG_KEEPALIVE_MAX_MS]/hbMs;
+    for(int c=0;c<sizeof(cases)/sizeof(cases[0]);c++) {
+        uint32_t rnd = 3;
+        long hb = 0;
+        long checks = 0;
+        long doors = 0;
+        double batt = 3300;
+        double last = 0;
+        double maxGap = 0;
+        int loss = cases[c].lossPct;
+        double nextDoor = cases[c].doorsPerDay?kr_next_door(&rnd, ticksPerDay, cases[c].doorsPerDay):INFINITY;
+        keepalive_init();
+        for(long t=1;t<=(long)(KR_DAYS*ticksPerDay);t++) {
+            batt -= KR_DRAIN_MV_TICK;
+            while (nextDoor<t) {
+                // a door frame, confirmed
+                doors++;
+                if ((blinky_test_rand(&rnd)%100)>=loss) {
+                    keepalive_uplink(batt, true, true);
+                } else {
+                    keepalive_failed();
+                }
+                maxGap = (nextDoor-last>maxGap)?(nextDoor-last):maxGap;
+                last = nextDoor;
+                nextDoor += kr_next_door(&rnd, ticksPerDay, cases[c].doorsPerDay);
+            }
+            uint8_t k = keepalive_tick();
+            if (k==KEEPALIVE_SKIP) {
+                continue;
+            }
+            hb++;
+            bool got = (blinky_test_rand(&rnd)%100)>=loss;
+            if (k==KEEPALIVE_CHECK) {
+                checks++;
+                if (got && (blinky_test_rand(&rnd)%100)>=loss) {
+                    keepalive_uplink(batt, false, true);
+                } else {
+                    keepalive_failed();
+                }
+            } else {
+                keepalive_uplink(batt, false, false);
+            }
+            maxGap = (t-last>maxGap)?(t-last):maxGap;
+            last = t;
+        }
+        double hbPerDay = hb/(double)KR_DAYS;
+        printf("keepalive %2d door changes/day, %2d%% loss : %.1f heartbeats/day (%.1f confirmed) + %.1f door frames, vs %.0f ticks, longest gap %.0f min\n",
+            cases[c].doorsPerDay, loss, hbPerDay, checks/(double)KR_DAYS, doors/(double)KR_DAYS, ticksPerDay, maxGap*hbMs/60000);
+        // the draws are fixed : any change of the counts is a change of behaviour
+        TEST_ASSERT(hb==cases[c].hb);
+        // alive : the longest time without an uplink is the ceiling, reached while nothing moves
+        TEST_ASSERT(fabs(maxGap-maxGapTicks)<0.01);
+    }
+}
@@ -0,0 +1,56 @@
+/**
+ Wyres private code
+ Transmit power control : steps down after LORA_TPC_STEP_AFTER good margins, back up on a short margin or a miss.
+ */
+
+#include "os/os.h"
+
+#include "tpc.h"
+#include "blinky_test.h"
+
+#define TS_MAX_DBM          (14)
+#define TS_DR               (0)
+// SNR at DR0 (floor -20dB) giving a margin that allows a step down, one that holds the power, and a short one
+#define TS_SNR_GOOD         (-20+MYNEWT_VAL(LORA_TPC_MARGIN_DB)+2)
+#define TS_SNR_HOLD         (-20+MYNEWT_VAL(LORA_TPC_MARGIN_DB))
+#define TS_SNR_SHORT        (-20+MYNEWT_VAL(LORA_TPC_MARGIN_DB)-1)
+
+// Margins at snr, with the power tpc asks for applied as the radio would
+static int8_t ts_margins(int8_t snr, int n) {
+    for(int i=0;i<n;i++) {
+        tpc_set(tpc_margin(snr, TS_DR));
+    }
+    return tpc_dbm();
+}
+
+TEST_CASE(tpc_step_test) {
+    tpc_init(TS_MAX_DBM);
+    TEST_ASSERT(tpc_dbm()==TS_MAX_DBM);
+    // one good margin short of a step : no change
+    TEST_ASSERT(ts_margins(TS_SNR_GOOD, MYNEWT_VAL(LORA_TPC_STEP_AFTER)-1)==TS_MAX_DBM);
+    // the next one steps down 2dB
+    TEST_ASSERT(ts_margins(TS_SNR_GOOD, 1)==TS_MAX_DBM-2);
+    // a margin just enough to hold breaks the run
+    ts_margins(TS_SNR_GOOD, MYNEWT_VAL(LORA_TPC_STEP_AFTER)-1);
+    TEST_ASSERT(ts_margins(TS_SNR_HOLD, 1)==TS_MAX_DBM-2);
+    TEST_ASSERT(ts_margins(TS_SNR_GOOD, MYNEWT_VAL(LORA_TPC_STEP_AFTER)-1)==TS_MAX_DBM-2);
+    // a short margin steps back up at once, and starts a new run
+    TEST_ASSERT(ts_margins(TS_SNR_SHORT, 1)==TS_MAX_DBM);
+    TEST_ASSERT(ts_margins(TS_SNR_GOOD, MYNEWT_VAL(LORA_TPC_STEP_AFTER)-1)==TS_MAX_DBM);
+    // never above the configured power
+    TEST_ASSERT(ts_margins(TS_SNR_SHORT, 3)==TS_MAX_DBM);
+
+    // all the way down : no lower than the min
+    TEST_ASSERT(ts_margins(TS_SNR_GOOD, 100)==MYNEWT_VAL(LORA_TPC_MIN_DBM));
+    // a power the radio refused is not taken as set
+    TEST_ASSERT(tpc_margin(TS_SNR_SHORT, TS_DR)==MYNEWT_VAL(LORA_TPC_MIN_DBM)+2);
+    TEST_ASSERT(tpc_dbm()==MYNEWT_VAL(LORA_TPC_MIN_DBM));
+    // the floor depends on the DR : the same SNR is short at SF7
+    TEST_ASSERT(tpc_margin(TS_SNR_GOOD, 5)==MYNEWT_VAL(LORA_TPC_MIN_DBM)+2);
+
+    // a missed ack steps up, a lost link goes back to full power
+    tpc_set(tpc_missed(false));
+    TEST_ASSERT(tpc_dbm()==MYNEWT_VAL(LORA_TPC_MIN_DBM)+2);
+    tpc_set(tpc_missed(true));
+    TEST_ASSERT(tpc_dbm()==TS_MAX_DBM);
+}